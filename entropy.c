@@ -0,0 +1,250 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "entropy.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef USE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+/* Random letters are drawn from a ChaCha20 keystream kept by each thread and
+   seeded from the kernel. Every time the buffer is refilled, the first 32
+   bytes of the new output replace the key and are erased, so earlier output
+   can't be recovered from the state. The key is seeded again after
+   ENTROPY_RESEED bytes, and after a fork, so that the child process doesn't
+   repeat the output of the parent. */
+
+#define ENTROPY_BLOCKS 16        /* ChaCha20 blocks per refill */
+#define ENTROPY_RESEED (1 << 20) /* bytes of output per seed */
+
+struct entropy_state {
+    uint32_t key[8];
+    unsigned char buf[ENTROPY_BLOCKS * 64];
+    size_t left;                 /* bytes at the end of buf not used yet */
+    size_t output;               /* bytes since seeding */
+    unsigned forks;              /* entropy_forks when seeded */
+    int seeded;
+};
+
+int entropy_fd = -1;
+
+pthread_once_t entropy_once = PTHREAD_ONCE_INIT;
+pthread_key_t entropy_key;
+int entropy_key_status;
+unsigned entropy_forks = 0; /* in the ancestry of this process */
+
+
+#define ROTL(n, x) ((x) << (n) | (x) >> (32 - (n)))
+#define QUARTER(a, b, c, d) \
+    (a += b, d = ROTL(16, d ^ a), c += d, b = ROTL(12, b ^ c), \
+     a += b, d = ROTL( 8, d ^ a), c += d, b = ROTL( 7, b ^ c))
+
+/* Writes a block of the keystream for the given block counter. */
+void entropy_block(const uint32_t* key, uint64_t counter, unsigned char* out) {
+    uint32_t in[16], x[16];
+    int i;
+
+    in[0] = 0x61707865; /* "expand 32-byte k" */
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+        in[4 + i] = key[i];
+    in[12] = (uint32_t)counter;
+    in[13] = (uint32_t)(counter >> 32);
+    in[14] = 0;
+    in[15] = 0;
+
+    memcpy(x, in, sizeof x);
+    for (i = 0; i < 10; i++) {
+        QUARTER(x[0], x[4], x[ 8], x[12]);
+        QUARTER(x[1], x[5], x[ 9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[ 8], x[13]);
+        QUARTER(x[3], x[4], x[ 9], x[14]);
+    }
+
+    for (i = 0; i < 16; i++) {
+        x[i] += in[i];
+        out[i*4    ] = (unsigned char)(x[i]      );
+        out[i*4 + 1] = (unsigned char)(x[i] >>  8);
+        out[i*4 + 2] = (unsigned char)(x[i] >> 16);
+        out[i*4 + 3] = (unsigned char)(x[i] >> 24);
+    }
+}
+
+/* Reads a new key from the kernel. */
+int entropy_seed(struct entropy_state* state) {
+    unsigned char seed[sizeof state->key];
+    size_t got = 0;
+    ssize_t len;
+    int i;
+
+#ifdef USE_GETRANDOM
+    while (got < sizeof seed) {
+        do
+            len = getrandom(seed + got, sizeof seed - got, 0);
+        while (len == -1 && errno == EINTR);
+        if (len <= 0)
+            break;
+        got += len;
+    }
+#endif
+    while (got < sizeof seed) {
+        do
+            len = read(entropy_fd, seed + got, sizeof seed - got);
+        while (len == -1 && errno == EINTR);
+        if (len <= 0) {
+            if (len == 0)
+                errno = EIO;
+            return -1;
+        }
+        got += len;
+    }
+
+    for (i = 0; i < 8; i++)
+        state->key[i] = (uint32_t)seed[i*4] | (uint32_t)seed[i*4 + 1] << 8 |
+                        (uint32_t)seed[i*4 + 2] << 16 |
+                        (uint32_t)seed[i*4 + 3] << 24;
+    memset(seed, 0, sizeof seed);
+    state->left = 0;
+    state->output = 0;
+    state->forks = entropy_forks;
+    state->seeded = 1;
+    return 0;
+}
+
+/* Refills the buffer, replacing the key with the start of the output. */
+void entropy_refill(struct entropy_state* state) {
+    int i;
+
+    for (i = 0; i < ENTROPY_BLOCKS; i++)
+        entropy_block(state->key, i, state->buf + i*64);
+    memcpy(state->key, state->buf, sizeof state->key);
+    memset(state->buf, 0, sizeof state->key);
+    state->left = sizeof state->buf - sizeof state->key;
+}
+
+void entropy_free(void* state) {
+    memset(state, 0, sizeof(struct entropy_state));
+    free(state);
+}
+
+void entropy_forked() {
+    entropy_forks++;
+}
+
+void entropy_init() {
+    if ((entropy_key_status = pthread_key_create(&entropy_key,
+                                                 entropy_free)) == 0)
+        entropy_key_status = pthread_atfork(NULL, NULL, entropy_forked);
+}
+
+/* Opens the kernel random device, which should be done before changing
+   root. */
+int entropy_open() {
+    int status;
+
+    if ((status = pthread_once(&entropy_once, entropy_init)) != 0 ||
+            (status = entropy_key_status) != 0) {
+        errno = status;
+        return -1;
+    }
+
+    do
+        entropy_fd = open("/dev/urandom", O_RDONLY);
+    while (entropy_fd == -1 && errno == EINTR);
+    if (entropy_fd == -1)
+        return -1;
+    if (fcntl(entropy_fd, F_SETFD, FD_CLOEXEC) == -1) {
+        close(entropy_fd);
+        entropy_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Fills s with len letters of the alphabet, uniformly distributed. Returns
+   -1 if the state couldn't be allocated or seeded. */
+int entropy_letters(char* s, size_t len) {
+    struct entropy_state* state;
+    unsigned char byte;
+    int status;
+
+    if ((status = pthread_once(&entropy_once, entropy_init)) != 0 ||
+            (status = entropy_key_status) != 0) {
+        errno = status;
+        return -1;
+    }
+    if ((state = pthread_getspecific(entropy_key)) == NULL) {
+        if ((state = calloc(1, sizeof *state)) == NULL)
+            return -1;
+        if ((status = pthread_setspecific(entropy_key, state)) != 0) {
+            free(state);
+            errno = status;
+            return -1;
+        }
+    }
+
+    if ((!state->seeded || state->forks != entropy_forks) &&
+            entropy_seed(state) == -1)
+        return -1;
+
+    while (len != 0) {
+        if (state->left == 0) {
+            if (state->output >= ENTROPY_RESEED && entropy_seed(state) == -1)
+                return -1;
+            entropy_refill(state);
+        }
+
+        /* rejection sampling, 256 - 256 % 65 = 195 */
+        byte = state->buf[sizeof state->buf - state->left];
+        state->buf[sizeof state->buf - state->left] = 0;
+        state->left--;
+        state->output++;
+        if (byte < 256 - 256 % (sizeof alphabet - 1)) {
+            *s++ = alphabet[byte % (sizeof alphabet - 1)];
+            len--;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "journal.h"
+
+#ifdef USE_DB185
+#include <db_185.h>
+#else
+#include <db.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* Stamps minted for a message are kept under "date:msgid:local@domain", so
+   that when the MTA fails a message after the milter accepted it and the
+   client sends it again, the stamps are added again without minting them.
+   Stamps are only looked up for the current date and are purged after it
+   changes. When there are too many, the first ones in key order are purged. */
+
+#define JOURNAL_MAX 10000 /* stamps kept */
+#define JOURNAL_SYNC 300  /* seconds between writing the journal to disk */
+
+DB* journal_db = NULL;
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+long journal_count = 0;
+time_t journal_sync = 0;
+
+
+/* Opens the journal in the given file, or keeps it in memory if NULL. */
+int journal_open(const char* file) {
+    BTREEINFO info;
+    DBT key, value;
+    u_int flag;
+    int fd, status;
+
+    memset(&info, 0, sizeof info);
+    info.minkeypage = 8;
+    info.compare = NULL;
+    info.prefix = NULL;
+    do
+        journal_db = dbopen(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+                            DB_BTREE, &info);
+    while (journal_db == NULL && errno == EINTR);
+    if (journal_db == NULL)
+        return -1;
+
+    if (file != NULL) {
+        if ((fd = journal_db->fd(journal_db)) == -1)
+            goto failed;
+        do
+            status = flock(fd, LOCK_EX | LOCK_NB);
+        while (status == -1 && errno == EINTR);
+        if (status == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+            goto failed;
+    }
+
+    memset(&key, 0, sizeof key);
+    memset(&value, 0, sizeof value);
+    for (flag = R_FIRST;
+         (status = journal_db->seq(journal_db, &key, &value, flag)) == 0;
+         flag = R_NEXT)
+        journal_count++;
+    if (status == -1)
+        goto failed;
+    return 0;
+
+failed:
+    status = errno;
+    journal_db->close(journal_db);
+    journal_db = NULL;
+    errno = status;
+    return -1;
+}
+
+int journal_close() {
+    return journal_db != NULL ? journal_db->close(journal_db) : 0;
+}
+
+/* Returns the stamp kept for the recipient of the message if it is for the
+   given date and has at least the given value, or NULL. */
+struct string* journal_find(const char* msgid, const char* rcpt,
+                            const char* date, int bits) {
+    const char* domain = strchr(rcpt, '\0') + 1;
+    char* s;
+    size_t size;
+    DBT key, value;
+    struct string* token = NULL;
+    int status;
+
+    if (journal_db == NULL)
+        return NULL;
+
+    size = strlen(date) + 1 + strlen(msgid) + 1 +
+           strlen(rcpt) + 1 + strlen(domain) + 1;
+    if ((s = malloc(size)) == NULL) {
+        syslog(LOG_ERR, "memory allocation failed");
+        return NULL;
+    }
+    sprintf(s, "%s:%s:%s@%s", date, msgid, rcpt, domain);
+
+    memset(&key, 0, sizeof key);
+    memset(&value, 0, sizeof value);
+    key.data = s;
+    key.size = strlen(s);
+
+    pthread_mutex_lock(&journal_mutex);
+    if ((status = journal_db->get(journal_db, &key, &value, 0)) == -1)
+        syslog(LOG_WARNING, "db->get() failed: %m; journal not used");
+    else if (status == 0) {
+        size = sizeof *token + value.size + 1;
+        if (size < value.size || (token = malloc(size)) == NULL)
+            syslog(LOG_ERR, "memory allocation failed");
+        else {
+            token->next = NULL;
+            memcpy(token->string, value.data, value.size);
+            token->string[value.size] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    free(s);
+
+    if (token != NULL && (parse_token(token->string, NULL) == -1 ||
+                          token_value(token->string, date, date) < bits)) {
+        free(token);
+        token = NULL;
+    }
+    return token;
+}
+
+/* Purges stamps for dates before and after the given one, and the first
+   stamps in key order while there are too many. */
+void journal_purge(const char* date) {
+    DBT key, value;
+    u_int flag;
+    int cmp;
+
+    memset(&key, 0, sizeof key);
+    memset(&value, 0, sizeof value);
+    for (flag = R_FIRST;;) {
+        switch (journal_db->seq(journal_db, &key, &value, flag)) {
+        case -1:
+            syslog(LOG_WARNING, "db->seq() failed: %m; "
+                   "old stamps will not be purged from journal");
+        case 1:
+            return;
+        }
+
+        cmp = memcmp(key.data, date, key.size < 6 ? key.size : 6);
+        if (flag == R_FIRST && cmp >= 0 && journal_count <= JOURNAL_MAX) {
+            flag = R_LAST;
+            continue;
+        } else if (flag == R_LAST && cmp <= 0)
+            return;
+
+        switch (journal_db->del(journal_db, &key, R_CURSOR)) {
+        case -1:
+            syslog(LOG_WARNING, "db->del() failed: %m; "
+                   "old stamps will not be purged from journal");
+            return;
+        case 1:
+            syslog(LOG_ERR, "internal error: key not found in journal");
+            return;
+        }
+        journal_count--;
+    }
+}
+
+/* Keeps the stamp for its recipient of the message. */
+void journal_add(const char* msgid, const char* token) {
+    const char *date, *resource, *end;
+    char* s;
+    DBT key, value;
+    time_t now;
+
+    if (journal_db == NULL)
+        return;
+
+    /* 1:bits:date:resource:... */
+    date = strchr(strchr(token, ':') + 1, ':') + 1;
+    resource = strchr(date, ':') + 1;
+    end = strchr(resource, ':');
+
+    if ((s = malloc((resource - date) + strlen(msgid) + 1 +
+                    (end - resource) + 1)) == NULL) {
+        syslog(LOG_ERR, "memory allocation failed");
+        return;
+    }
+    sprintf(s, "%.*s%s:%.*s", (int)(resource - date), date, msgid,
+            (int)(end - resource), resource);
+
+    memset(&key, 0, sizeof key);
+    memset(&value, 0, sizeof value);
+    key.data = s;
+    key.size = strlen(s);
+    value.data = (void*)token;
+    value.size = strlen(token);
+
+    pthread_mutex_lock(&journal_mutex);
+
+    /* replaces a stamp of lower value */
+    switch (journal_db->put(journal_db, &key, &value, R_NOOVERWRITE)) {
+    case 0:
+        journal_count++;
+        break;
+    case 1:
+        if (journal_db->put(journal_db, &key, &value, 0) != -1)
+            break;
+        /* fall through */
+    case -1:
+        syslog(LOG_WARNING, "db->put() failed: %m; stamp not journaled");
+    }
+    journal_purge(date);
+
+    /* sync to disk every 5 minutes */
+    if ((now = time(NULL)) != (time_t)-1 && now >= journal_sync) {
+        if (journal_sync != 0 && journal_db->sync(journal_db, 0) == -1)
+            syslog(LOG_WARNING, "db->sync() failed: %m");
+        journal_sync = now + JOURNAL_SYNC;
+    }
+
+    pthread_mutex_unlock(&journal_mutex);
+    free(s);
+}
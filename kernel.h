@@ -0,0 +1,209 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Multi-lane SHA-1 rounds for the last block of a token being minted. This
+   file is included by mint.c once for each instruction set, with the lane
+   vector type V, the operations on it and KERNEL_SUFFIX defined. */
+
+#define KERNEL_CAT2(a, b) a##b
+#define KERNEL_CAT(a, b) KERNEL_CAT2(a, b)
+#define KERNEL(name) KERNEL_CAT(name, KERNEL_SUFFIX)
+
+#ifndef VCH
+#define VCH(b, c, d) VXOR(VAND(b, VXOR(c, d)), d)
+#endif
+#ifndef VPARITY
+#define VPARITY(b, c, d) VXOR(VXOR(b, c), d)
+#endif
+#ifndef VMAJ
+#define VMAJ(b, c, d) VOR(VAND(b, c), VAND(VOR(b, c), d))
+#endif
+
+#undef S
+#define S(n, x) VROL(x, n)
+
+/* Runs the rounds of the last block of m from round 13 for each lane, with the
+   lane's value of word 13 taken from words, and returns the registers to be
+   added to the chaining value. */
+KERNEL_TARGET __attribute__((always_inline))
+static inline void KERNEL(mint_rounds_)(const struct mint_block* m,
+                                        const uint32_t* words, V* out) {
+    V a, b, c, d, e, f, r;
+    V u[16];
+    V* w = &u[15];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[0-i] = VSET1(m->data[i]);
+    w[0-13] = VLOAD(words);
+
+    f = VSET1(m->state[0]);
+    a = VSET1(m->state[1]);
+    b = VSET1(m->state[2]);
+    c = VSET1(m->state[3]);
+    d = VSET1(m->state[4]);
+
+#undef M
+#define M(i, a, b, c, d, e, f) \
+      R(i,   a, b, c, d, e, f) \
+      R(i+1, f, a, b, c, d, e) \
+      R(i+2, e, f, a, b, c, d) \
+      R(i+3, d, e, f, a, b, c) \
+      R(i+4, c, d, e, f, a, b) \
+      R(i+5, b, c, d, e, f, a)
+
+#undef R
+#define R(i, a, b, c, d, e, f) \
+    f = VADD(VADD(S(5, a), VCH(b, c, d)), \
+             VADD(VADD(e, W(i)), VSET1(0x5a827999))); \
+    b = S(30, b);
+
+#undef W
+#define W(i) \
+    (w[0-(i)])
+
+    R(13, f, a, b, c, d, e)
+    R(14, e, f, a, b, c, d)
+    R(15, d, e, f, a, b, c)
+
+/* schedule words that don't depend on word 13 */
+#undef CONSTANT_W
+#define CONSTANT_W(i) ((i) == 17 || (i) == 18 || (i) == 20 || (i) == 23 || \
+                       (i) == 26)
+
+#undef W
+#define W(i) \
+    (CONSTANT_W(i) ? \
+        (w[0-(i)%16] = VSET1(m->w[i])) : \
+        (r = VXOR(VXOR(w[0-(i+13)%16], w[0-(i+8)%16]), \
+                  VXOR(w[0-(i+2)%16], w[0-(i)%16])), \
+             w[0-(i)%16] = S(1, r)))
+
+    R(16, c, d, e, f, a, b)
+    R(17, b, c, d, e, f, a)
+    R(18, a, b, c, d, e, f)
+    R(19, f, a, b, c, d, e)
+
+#undef R
+#define R(i, a, b, c, d, e, f) \
+    f = VADD(VADD(S(5, a), VPARITY(b, c, d)), \
+             VADD(VADD(e, W(i)), VSET1(0x6ed9eba1))); \
+    b = S(30, b);
+
+    M(20, e, f, a, b, c, d)
+    M(26, e, f, a, b, c, d)
+    M(32, e, f, a, b, c, d)
+    R(38, e, f, a, b, c, d)
+    R(39, d, e, f, a, b, c)
+
+#undef R
+#define R(i, a, b, c, d, e, f) \
+    f = VADD(VADD(S(5, a), VMAJ(b, c, d)), \
+             VADD(VADD(e, W(i)), VSET1(0x8f1bbcdc))); \
+    b = S(30, b);
+
+    M(40, c, d, e, f, a, b)
+    M(46, c, d, e, f, a, b)
+    M(52, c, d, e, f, a, b)
+    R(58, c, d, e, f, a, b)
+    R(59, b, c, d, e, f, a)
+
+#undef R
+#define R(i, a, b, c, d, e, f) \
+    f = VADD(VADD(S(5, a), VPARITY(b, c, d)), \
+             VADD(VADD(e, W(i)), VSET1(0xca62c1d6))); \
+    b = S(30, b);
+
+    M(60, a, b, c, d, e, f)
+    M(66, a, b, c, d, e, f)
+    M(72, a, b, c, d, e, f)
+    R(78, a, b, c, d, e, f)
+    R(79, f, a, b, c, d, e)
+
+    out[0] = e;
+    out[1] = f;
+    out[2] = a;
+    out[3] = b;
+    out[4] = c;
+}
+
+/* Full digests of the last block, for checking the kernel. */
+KERNEL_TARGET
+void KERNEL(mint_final_)(const struct mint_block* m, const uint32_t* words,
+                         struct mint_lanes* x) {
+    V out[5];
+    int i;
+
+    KERNEL(mint_rounds_)(m, words, out);
+    for (i = 0; i < 5; i++)
+        VSTORE(x->digest[i], VADD(VSET1(m->digest[i]), out[i]));
+}
+
+/* Returns a mask of lanes whose digest starts with the given number of zero
+   bits (1 to 32). Only the first digest word is computed, so the rounds that
+   only contribute to the others are dropped by the compiler. */
+KERNEL_TARGET
+int KERNEL(mint_test_)(const struct mint_block* m, const uint32_t* words,
+                       int bits) {
+    V out[5];
+
+    KERNEL(mint_rounds_)(m, words, out);
+    return VZERO(VSHR(VADD(VSET1(m->digest[0]), out[0]), 32 - bits));
+}
+
+/* Same for more than 32 bits, checking up to 64 bits in the first two digest
+   words; lanes with more bits are checked further by the caller. */
+KERNEL_TARGET
+int KERNEL(mint_test_wide_)(const struct mint_block* m, const uint32_t* words,
+                            int bits) {
+    V out[5];
+
+    KERNEL(mint_rounds_)(m, words, out);
+    return VZERO(VADD(VSET1(m->digest[0]), out[0])) &
+           VZERO(VSHR(VADD(VSET1(m->digest[1]), out[1]),
+                      bits < 64 ? 64 - bits : 0));
+}
+
+#undef V
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VROL
+#undef VSHR
+#undef VZERO
+#undef VCH
+#undef VPARITY
+#undef VMAJ
+#undef KERNEL_SUFFIX
+#undef KERNEL_TARGET
@@ -0,0 +1,190 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "load.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* Minting load is judged by the expected time to mint the stamps queued and,
+   where the kernel provides it, by the share of time that tasks were waiting
+   for a processor. While either is high the value of new stamps is reduced by
+   one more bit, and while both are low by one less. The load is looked at once
+   a second by a thread of its own, however many messages come in. */
+
+#define PRESSURE_HIGH 50 /* % of the last 10 seconds */
+#define PRESSURE_LOW 20
+
+#define STATS_INTERVAL 300 /* seconds between logging the load */
+
+int load_reduction = 0;
+
+int load_fd = -1;
+pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+time_t load_logged = 0;
+
+double load_high;  /* seconds of backlog */
+int load_limit;    /* bits */
+
+
+/* Opens the CPU pressure stall information, which should be done before
+   changing root. */
+int load_open() {
+    do
+        load_fd = open("/proc/pressure/cpu", O_RDONLY);
+    while (load_fd == -1 && errno == EINTR);
+    if (load_fd == -1)
+        return -1;
+    if (fcntl(load_fd, F_SETFD, FD_CLOEXEC) == -1) {
+        close(load_fd);
+        load_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the percentage of the last 10 seconds in which some tasks were
+   waiting for a processor, or -1 if not available. */
+int load_pressure() {
+    char buf[256], *s;
+    ssize_t len;
+
+    if (load_fd == -1)
+        return -1;
+    do
+        len = pread(load_fd, buf, sizeof buf - 1, 0);
+    while (len == -1 && errno == EINTR);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+
+    if (strncmp(buf, "some ", 5) || (s = strstr(buf, "avg10=")) == NULL)
+        return -1;
+    return strtol(s + 6, NULL, 10);
+}
+
+void load_stats(struct pool_stats* stats, int* pressure) {
+    pool_stats(stats);
+    *pressure = load_pressure();
+}
+
+/* Steps the reduction, up to load_limit bits, and logs the load every few
+   minutes. */
+void load_update() {
+    struct pool_stats stats;
+    int pressure, reduction;
+    char percent[16];
+    time_t now;
+
+    load_stats(&stats, &pressure);
+    reduction = load_reduction;
+    if (stats.backlog > load_high || pressure > PRESSURE_HIGH)
+        reduction++;
+    else if (stats.backlog < load_high / 4 && pressure < PRESSURE_LOW)
+        reduction--;
+    if (reduction > load_limit)
+        reduction = load_limit;
+    if (reduction < 0)
+        reduction = 0;
+
+    now = time(NULL);
+    if (reduction != load_reduction || now >= load_logged + STATS_INTERVAL) {
+        if (pressure >= 0)
+            snprintf(percent, sizeof percent, "%d%%", pressure);
+        else
+            strcpy(percent, "unknown");
+        syslog(reduction != load_reduction ? LOG_NOTICE : LOG_INFO,
+               "minting load: %d messages and %.1f seconds queued, "
+               "%.3f Mhash/s, CPU pressure %s, value reduced by %d bits",
+               stats.jobs, stats.backlog, stats.rate / 1e6, percent,
+               reduction);
+        load_logged = now;
+    }
+
+    pthread_mutex_lock(&load_mutex);
+    load_reduction = reduction;
+    pthread_mutex_unlock(&load_mutex);
+}
+
+void* load_worker(void* arg) {
+    for (;; sleep(1))
+        load_update();
+
+    return NULL;
+}
+
+/* Starts following the load, with a backlog of the given seconds being high
+   and the reduction going up to limit bits. */
+int load_start(double high, int limit) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t set, old;
+    int status;
+
+    load_high = high;
+    load_limit = limit;
+
+    if ((status = pthread_attr_init(&attr)) != 0 ||
+            (status = pthread_attr_setdetachstate(
+                &attr, PTHREAD_CREATE_DETACHED)) != 0) {
+        errno = status;
+        return -1;
+    }
+
+    /* signals are left to the libmilter signal thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    status = pthread_create(&thread, &attr, load_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the reduction, up to max bits. */
+int load_get(int max) {
+    int reduction;
+
+    pthread_mutex_lock(&load_mutex);
+    reduction = load_reduction < max ? load_reduction : max;
+    pthread_mutex_unlock(&load_mutex);
+    return reduction;
+}
@@ -28,17 +28,21 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "entropy.h"
+#include "journal.h"
+#include "load.h"
+#include "mint.h"
+#include "pool.h"
+#include "premint.h"
+#include "remote.h"
 #include "rfc2822.h"
+#include "service.h"
 #include "sha1.h"
+#include "spent.h"
 #include "util.h"
 
 #include <libmilter/mfapi.h>
 
-#ifdef USE_DB185
-#include <db_185.h>
-#else
-#include <db.h>
-#endif
 
 #include <err.h>
 #include <errno.h>
@@ -54,13 +58,13 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 
-#define COUNTER_MAX 16
-/* 65^1 + 65^2 + ... + 65^16 = 10^29 hashes */
-/* 10^29 hashes / 1 Ghash/sec = 3*10^12 years */
-
 #define RANDOM_LEN 16
 /* 1000 messages/second = 10^8 messages/day */
 /* 65^16 = 10^29 choices: collision probability/day = 5*10^-14 */
+/* rand is extended by up to 63 characters to align the counter (see mint.h) */
+
+#define LOAD_BACKLOG 10 /* seconds of minting queued that is a high load,
+                           unless -l or -t is given */
 
 
 /* configuration */
@@ -70,11 +74,13 @@ struct string* cover_domains = NULL;
 int mint_bits = 0, reduce_bits = 0;
 int check_bits = 0;
 long timeout = 0;
+int timeout_cpu = 0; /* timeout is of the workers' time rather than elapsed */
+long latency = 0; /* target minting time */
+int load_bits = 0; /* minimum under load */
+int mint_workers = 0;
+int overflow_tempfail = 0; /* when the minting queue is full */
+int mint_early = 0; /* start minting when recipients are seen in headers */
 
-int random_fd;
-DB* db_spent = NULL;
-pthread_mutex_t db_mutex;
-time_t db_sync = 0;
 
 struct hcfi_priv {
     /* decision parameters */
@@ -93,8 +99,17 @@ struct hcfi_priv {
     /* MTA parameters */
     char* queue_id;
     char* my_hostname;
+    char client[INET6_ADDRSTRLEN]; /* address of SMTP client */
+
+    /* sender for sharing the minting workers */
+    char* sender;
+
+    /* stamps being minted */
+    struct mint_job* job;
+    struct early_stamp* early;
 
     /* message information */
+    char* message_id; /* for the journal of minted stamps */
     struct string* env_rcpts;
     struct string* msg_rcpts;
     struct string* tokens; /* only syntactically valid tokens */
@@ -114,6 +129,16 @@ struct hcfi_priv {
 
 };
 
+/* A stamp started while the rest of the message is being received. */
+struct early_stamp {
+    const char* rcpt; /* in msg_rcpts */
+    char date[6+1];
+    struct string* token; /* without counter, NULL once taken by eom */
+    struct mint_job job;
+    struct mint_stamp stamp;
+    struct early_stamp* next;
+};
+
 char* null_queue_id = "(unknown)";
 
 char header_hashcash[] = "X-Hashcash"; /* +2 is used as "Hashcash" */
@@ -131,6 +156,10 @@ sfsistat hcfi_connect(SMFICTX* ctx, char* hostname, _SOCK_ADDR* hostaddr) {
 
     priv->queue_id = null_queue_id;
     priv->my_hostname = NULL;
+    priv->sender = NULL;
+    priv->job = NULL;
+    priv->early = NULL;
+    priv->message_id = NULL;
     priv->env_rcpts = NULL;
     priv->msg_rcpts = NULL;
     priv->tokens = NULL;
@@ -144,6 +173,10 @@ sfsistat hcfi_connect(SMFICTX* ctx, char* hostname, _SOCK_ADDR* hostaddr) {
         return SMFIS_ACCEPT;
     }
 
+    if (hostaddr == NULL ||
+            format_ipaddr(hostaddr, priv->client, sizeof priv->client) == -1)
+        strcpy(priv->client, "unknown");
+
     /* check if we need to cover this message based on IP address */
     if (cover_ipaddrs != NULL)
         if (hostaddr == NULL) {
@@ -180,6 +213,215 @@ void get_syms(SMFICTX* ctx) {
     }
 }
 
+/* Returns the key by which the minting workers are shared between senders:
+   the SMTP AUTH identity, else the sender address, else the client address.
+   Returns NULL if memory allocation failed. */
+char* sender_key(SMFICTX* ctx, const char* path, const char* client) {
+    const char* authen;
+    char *mailbox, *key;
+    size_t len = strlen(path);
+
+    if ((authen = smfi_getsymval(ctx, "{auth_authen}")) != NULL && *authen) {
+        len = strlen(authen);
+        if ((key = malloc(5 + len + 1)) != NULL)
+            sprintf(key, "auth:%s", authen);
+        return key;
+    }
+
+    if ((mailbox = malloc(len + 1)) == NULL)
+        return NULL;
+    if (rfc5321_mailbox(path, mailbox) != -1 && *mailbox) {
+        len = strlen(mailbox);
+        len += 1 + strlen(mailbox + len + 1);
+        if ((key = malloc(5 + len + 1)) != NULL)
+            sprintf(key, "from:%s@%s", mailbox, strchr(mailbox, '\0') + 1);
+        free(mailbox);
+        return key;
+    }
+    free(mailbox);
+
+    if ((key = malloc(3 + strlen(client) + 1)) != NULL)
+        sprintf(key, "ip:%s", client);
+    return key;
+}
+
+/* Keeps the MTA waiting for minting to finish. This is called from
+   hcfi_eom_mint() while it waits for the workers. */
+int report_progress(void* ctx) {
+    return smfi_progress(ctx) == MI_FAILURE ? -1 : 0;
+}
+
+/* Stops minting for the message, if any, and frees the jobs. */
+void cancel_minting(struct hcfi_priv* priv) {
+    struct early_stamp* early;
+
+    if (priv->job != NULL) {
+        pool_cancel(priv->job);
+        free(priv->job->stamps);
+        free(priv->job);
+        priv->job = NULL;
+    }
+    while ((early = priv->early) != NULL) {
+        priv->early = early->next;
+        pool_cancel(&early->job);
+        free(early->token);
+        free(early);
+    }
+}
+
+/* Returns the value of stamps for a message with count recipients. The
+   reduction to fit the target time is logged unless queue_id is NULL. */
+int message_bits(int count, const char* queue_id) {
+    int bits, fit;
+    size_t size;
+
+    /* reduce mint bits */
+    bits = mint_bits;
+    if (reduce_bits != 0 && reduce_bits < mint_bits)
+        for (size = count; bits > reduce_bits && size > 1; size /= 2)
+            bits--;
+
+    /* reduce them under load, but not below the -b bits */
+    bits -= load_get(load_bits != 0 && bits > load_bits ? bits - load_bits : 0);
+
+    /* lower them further to what can be minted in the target time */
+    if (latency != 0 && (fit = pool_fit(bits, reduce_bits ? reduce_bits : 1,
+                                        count, latency)) < bits) {
+        if (queue_id != NULL)
+            syslog(LOG_INFO, "%s: minting %d bits to fit in %ld seconds",
+                   queue_id, fit, latency);
+        bits = fit;
+    }
+    return bits > 0 ? bits : 1;
+}
+
+/* Returns a token for the recipient without the counter, and lays out the
+   stamp for minting it. Returns NULL on failure. */
+struct string* begin_token(const char* queue_id, const char* date,
+                           const char* rcpt, int bits,
+                           struct mint_stamp* stamp) {
+    const char* domain;
+    size_t size, print_size, local_len, domain_len, random_len;
+    struct string* token;
+    char* s;
+    int counter_len = mint_counter_len(bits);
+
+    local_len = strlen(rcpt);
+    domain = rcpt + local_len + 1;
+    domain_len = strlen(domain);
+
+    /* prepare a token */
+    print_size = 1 + 1                          /* version : */
+               + 3 + 1                          /* bits up to 160 : */
+               + 6 + 1                          /* date : */
+               + local_len + 1 + domain_len + 1 /* resource : */
+               + 0 + 1;                         /* extension : */
+    size = sizeof *token
+         + print_size
+         + RANDOM_LEN + 63 + 1 /* random : */
+         + MINT_COUNTER_MAX    /* counter */
+         + 1;                  /* null */
+    if (size < local_len || local_len - size < domain_len ||
+            (token = malloc(size)) == NULL) {
+        syslog(LOG_ERR, "memory allocation failed");
+        return NULL;
+    }
+
+    /* first part of token */
+    token->string[print_size] = '\0';
+    if (snprintf(token->string, print_size+2, "1:%d:%s:%s@%s::", bits,
+                 date, rcpt, domain) < 0 || token->string[print_size]) {
+        syslog(LOG_ERR, "%s: internal error: snprintf() failed", queue_id);
+        goto failed;
+    }
+    s = strchr(token->string, '\0');
+
+    /* write rand into token, long enough to put the counter at the end of
+       the last block */
+    random_len = RANDOM_LEN + mint_pad(s - token->string + RANDOM_LEN + 1,
+                                       counter_len);
+    if (entropy_letters(s, random_len) == -1) {
+        syslog(LOG_ERR, "%s: couldn't draw random letters: %m", queue_id);
+        goto failed;
+    }
+    s += random_len;
+    *s++ = ':';
+    *s = '\0';
+
+    /* hash initial part of string */
+    mint_begin(&stamp->block, token->string, s - token->string, counter_len);
+    pool_stamp(stamp, bits);
+    return token;
+
+failed:
+    free(token);
+    return NULL;
+}
+
+/* Returns the value of stamps minted ahead of time, that of a message to one
+   recipient without load, fitted to -l with the workers' current speed. */
+int premint_value() {
+    return latency ? pool_fit(mint_bits, reduce_bits ? reduce_bits : 1, 1,
+                              latency) : mint_bits;
+}
+
+/* Makes tokens for stamps minted ahead of time. */
+struct string* premint_token(const char* rcpt, const char* date, int bits,
+                             struct mint_stamp* stamp) {
+    return begin_token("premint", date, rcpt, bits, stamp);
+}
+
+/* Makes tokens for stamps requested through the service socket. */
+struct string* service_token(const char* rcpt, const char* date, int bits,
+                             struct mint_stamp* stamp) {
+    return begin_token("service", date, rcpt, bits, stamp);
+}
+
+/* Starts minting the stamp for a recipient found in the headers, so that it
+   overlaps with receiving the rest of the message. */
+void begin_early(struct hcfi_priv* priv, const char* rcpt) {
+    time_t tt;
+    int count = 0;
+    struct string* addr;
+    struct early_stamp* early;
+
+    /* skipped at end of message */
+    if (!rfc2822_is_dot_atom_text(rcpt) ||
+            !rfc2822_is_dot_atom_text(strchr(rcpt, '\0') + 1))
+        return;
+
+    /* the value for the recipients so far is at least that of the message */
+    for (addr = priv->msg_rcpts; addr != NULL; addr = addr->next)
+        count++;
+
+    if ((early = calloc(1, sizeof *early)) == NULL) {
+        syslog(LOG_ERR, "memory allocation failed");
+        return;
+    }
+    if ((tt = time(NULL)) == (time_t)-1 ||
+            format_date(tt, 0, early->date, sizeof early->date - 1) == -1 ||
+            (early->token = begin_token(priv->queue_id, early->date, rcpt,
+                                        message_bits(count, NULL),
+                                        &early->stamp)) == NULL) {
+        free(early);
+        return;
+    }
+    early->rcpt = rcpt;
+    early->job.stamps = &early->stamp;
+    early->job.count = 1;
+    early->job.key = priv->sender;
+    early->job.early = 1;
+
+    /* if there's no room, it's minted at end of message or not at all */
+    if (pool_submit(&early->job, timeout) == -1) {
+        free(early->token);
+        free(early);
+        return;
+    }
+    early->next = priv->early;
+    priv->early = early;
+}
+
 sfsistat hcfi_envfrom(SMFICTX* ctx, char** argv) {
     char* mailbox;
     const char* auth_type;
@@ -193,6 +435,8 @@ sfsistat hcfi_envfrom(SMFICTX* ctx, char** argv) {
     get_syms(ctx);
 
     /* initialize per-message variables */
+    cancel_minting(priv);
+    free(priv->message_id);        priv->message_id = NULL;
     free_strings(priv->env_rcpts); priv->env_rcpts = NULL;
     free_strings(priv->msg_rcpts); priv->msg_rcpts = NULL;
     free_strings(priv->tokens);    priv->tokens = NULL;
@@ -243,6 +487,13 @@ sfsistat hcfi_envfrom(SMFICTX* ctx, char** argv) {
         free(mailbox);
     }
 
+    free(priv->sender);
+    priv->sender = NULL;
+    if (priv->mode == 1 && !priv->ignore &&
+            (priv->sender = sender_key(ctx, argv[0], priv->client)) == NULL)
+        syslog(LOG_WARNING, "memory allocation failed, "
+               "sender will not get a fair share of minting");
+
     return SMFIS_CONTINUE;
 
 failed:
@@ -339,12 +590,25 @@ sfsistat hcfi_header(SMFICTX* ctx, char* name, char* value) {
                 memcpy(mailbox->string, item, len);
                 mailbox->next = priv->msg_rcpts;
                 priv->msg_rcpts = mailbox;
+
+                if (mint_early && priv->mode == 1)
+                    begin_early(priv, mailbox->string);
             }
         }
         free(list);
         return SMFIS_CONTINUE;
     }
 
+    /* stamps are journaled for messages sent again */
+    if (priv->mode == 1 && !priv->ignore &&
+            !strcasecmp(name, "Message-ID")) {
+        free(priv->message_id);
+        if ((priv->message_id = strdup(value)) == NULL)
+            syslog(LOG_WARNING, "memory allocation failed, "
+                   "stamps will not be journaled");
+        return SMFIS_CONTINUE;
+    }
+
     if ((x_hashcash = !strcasecmp(name, header_hashcash)) ||
                       !strcasecmp(name, header_hashcash + 2)) {
         if (priv->mode == 2) {
@@ -369,6 +633,7 @@ sfsistat hcfi_header(SMFICTX* ctx, char* name, char* value) {
         } else {
             /* skip messages covered by tokens for outgoing messages */
             priv->ignore = 1;
+            cancel_minting(priv);
             if (priv->remove_hashcash < 0) {
                 priv->hashcash_count[x_hashcash]++;
                 if (token_special(value, "skip"))
@@ -448,165 +713,74 @@ failed:
 }
 
 
-struct iteration {
-    char* counter_last;
-    int bits;
-    int error;
-    long tick_tries;
-    long tries_per_tick;
-    uint64_t total_tries;
+/* Returns -1 if the message should be rejected with a temporary failure. */
+int hcfi_eom_mint(SMFICTX* ctx) {
     struct timespec ts_start, ts;
-    SMFICTX* ctx;
-    const char* queue_id;
-};
-
-#undef CLOCK
-#ifdef CLOCK_THREAD_CPUTIME_ID
-    #define CLOCK CLOCK_THREAD_CPUTIME_ID
-#else
-    #define CLOCK CLOCK_MONOTONIC
-#endif
-
-int tick(struct iteration* it) {
-    struct timespec last_time, tick_delta;
-
-    it->total_tries += it->tick_tries;
-    it->tick_tries = 0;
-
-    if (timeout) {
-        last_time = it->ts;
-
-        if (clock_gettime(CLOCK, &it->ts) == -1) {
-            syslog(LOG_ERR, "%s: clock_gettime() failed: %m", it->queue_id);
-            it->error = 1;
-            return 1;
-        }
-
-        if (ts_delta(&it->ts, &it->ts_start) >= 0) {
-            if (it->ts.tv_sec >= timeout) {
-                syslog(LOG_INFO, "%s: spent too long minting", it->queue_id);
-                it->error = 1;
-                return 1;
-            }
-
-            /* report progress every second if timeout is set */
-            if (it->ts.tv_sec > last_time.tv_sec)
-                smfi_progress(it->ctx);
-
-            /* scale tries_per_tick to one tick per 200-300 ms */
-            tick_delta = it->ts;
-            if (ts_delta(&tick_delta, &last_time) >= 0) {
-                if (tick_delta.tv_sec > 0 || tick_delta.tv_nsec > 500000000l)
-                    it->tries_per_tick /= 2;
-                else if (tick_delta.tv_nsec > 300000000l)
-                    it->tries_per_tick = it->tries_per_tick * 5 / 6;
-                else if (tick_delta.tv_nsec < 200000000l)
-                    if (it->tries_per_tick < LONG_MAX / 2)
-                        it->tries_per_tick *= 2;
-
-                if (it->tries_per_tick < 1)
-                    it->tries_per_tick = 1;
-            }
-        }
-    }
-
-    return 0;
-}
-
-int iterate_counter(struct iteration* it,
-                    const struct sha1_info* hash_head, int len) {
-    struct sha1_info hash;
-    int c, i;
-
-    for (c = 0; c < (int)(sizeof alphabet - 1); c++) {
-        hash = *hash_head;
-        sha1_char(&hash, alphabet[c]);
-
-        if (len > 0) {
-            if (iterate_counter(it, &hash, len - 1)) {
-                it->counter_last[-len] = alphabet[c];
-                return 1;
-            }
-        } else {
-            sha1_done(&hash);
-
-            for (i = 0; i < it->bits / 32; i++)
-                if (hash.digest[i])
-                    goto again;
-            if (it->bits % 32 != 0 && hash.digest[i] >> 32 - it->bits % 32)
-                goto again;
-
-            *it->counter_last = alphabet[c];
-            return 1; /* found one */
-
-        again:
-            if (++it->tick_tries == it->tries_per_tick && tick(it))
-                return 1;
-        }
-    }
-
-    return 0;
-}
-
-void hcfi_eom_mint(SMFICTX* ctx) {
-    struct iteration it;
+    struct pool_watch watch;
     time_t tt;
-    ssize_t random_left = 0;
-    unsigned char random[RANDOM_LEN*2];
     char date[6+1];
     const char *local, *domain;
-    size_t size, print_size, local_len, domain_len;
+    size_t size;
     struct string *addr, *token, *tokens;
     char* s;
-    int len;
-    struct sha1_info hash;
-    char counter[COUNTER_MAX];
+    int i, done, bits, count, counter_len;
+    int started, early_count, reused, stocked, minted;
+    struct mint_job* job;
+    struct mint_stamp** stamps = NULL; /* in order of tokens being made */
+    struct mint_stamp ready; /* stands for stamps already minted */
+    struct early_stamp* early;
     long ktries_per_sec;
     struct hcfi_priv* priv = smfi_getpriv(ctx);
 
     /* timeout */
-    if (clock_gettime(CLOCK, &it.ts_start) == -1) {
+    if (pool_clock(&ts_start) == -1) {
         syslog(LOG_ERR, "%s: clock_gettime() failed: %m", priv->queue_id);
-        return;
+        cancel_minting(priv);
+        return 0;
     }
-    it.bits = mint_bits;
-    it.error = 0;
-    it.tick_tries = 0;
-    it.tries_per_tick = 100;
-    it.total_tries = 0;
-    it.ts.tv_sec = 0;
-    it.ts.tv_nsec = 0;
-    it.ctx = ctx;
-    it.queue_id = priv->queue_id;
 
     /* current date */
     if ((tt = time(NULL)) == (time_t)-1) {
         syslog(LOG_ERR, "%s: time() failed", priv->queue_id);
-        return;
+        cancel_minting(priv);
+        return 0;
     }
     if (format_date(tt, 0, date, sizeof date - 1) == -1) {
         syslog(LOG_ERR, "%s: gmtime_r() failed", priv->queue_id);
-        return;
+        cancel_minting(priv);
+        return 0;
     }
 
-    /* reduce mint bits */
-    if (reduce_bits != 0 && reduce_bits < mint_bits) {
-        size = 0;
-        for (addr = priv->msg_rcpts; addr != NULL; addr = addr->next)
-            size++;
+    /* count recipients */
+    count = 0;
+    for (addr = priv->msg_rcpts; addr != NULL; addr = addr->next)
+        count++;
+
+    bits = message_bits(count, priv->queue_id);
 
-        for (; it.bits > reduce_bits && size > 1; size /= 2)
-            it.bits--;
+    /* the job is kept with the message so that it can be cancelled */
+    if ((job = priv->job = calloc(1, sizeof *job)) == NULL ||
+            count != 0 &&
+            ((job->stamps = calloc(count, sizeof *job->stamps)) == NULL ||
+             (stamps = calloc(count, sizeof *stamps)) == NULL)) {
+        syslog(LOG_ERR, "memory allocation failed");
+        cancel_minting(priv);
+        return 0;
     }
+    job->key = priv->sender;
 
     /* repeat for each recipient */
     tokens = NULL;
     token = NULL;
+    started = 0;
+    early_count = 0;
+    reused = 0;
+    stocked = 0;
+    memset(&ready, 0, sizeof ready);
+    ready.found = 1;
     for (addr = priv->msg_rcpts; addr != NULL; addr = addr->next) {
         local = addr->string;
-        local_len = strlen(local);
-        domain = local + local_len + 1;
-        domain_len = strlen(domain);
+        domain = strchr(local, '\0') + 1;
 
         if (!rfc2822_is_dot_atom_text(local) ||
             !rfc2822_is_dot_atom_text(domain)) {
@@ -615,106 +789,154 @@ void hcfi_eom_mint(SMFICTX* ctx) {
             continue;
         }
 
-        /* prepare a token */
-        print_size = 1 + 1                          /* version : */
-                   + 3 + 1                          /* bits up to 160 : */
-                   + 6 + 1                          /* date : */
-                   + local_len + 1 + domain_len + 1 /* resource : */
-                   + 0 + 1;                         /* extension : */
-        size = sizeof *token
-             + print_size
-             + RANDOM_LEN + 1 /* random : */
-             + COUNTER_MAX    /* counter */
-             + 1;             /* null */
-        if (size < local_len || local_len - size < domain_len ||
-                (token = malloc(size)) == NULL) {
-            syslog(LOG_ERR, "memory allocation failed");
-            goto failed;
+        premint_learn(local);
+
+        /* take the stamp from an earlier attempt to send the message */
+        if (priv->message_id != NULL &&
+                (token = journal_find(priv->message_id, local, date,
+                                      bits)) != NULL) {
+            stamps[started++] = &ready;
+            reused++;
+            token->next = tokens;
+            tokens = token;
+            token = NULL;
+            continue;
         }
 
-        /* first part of token */
-        token->string[print_size] = '\0';
-        if (snprintf(token->string, print_size+2, "1:%d:%s:%s@%s::", it.bits,
-                     date, local, domain) < 0 || token->string[print_size]) {
-            syslog(LOG_ERR, "%s: internal error: snprintf() failed",
-                   priv->queue_id);
-            goto failed;
+        /* take the stamp minted ahead for a frequent recipient */
+        if ((token = premint_take(local, date, bits)) != NULL) {
+            if (priv->message_id != NULL)
+                journal_add(priv->message_id, token->string);
+            stamps[started++] = &ready;
+            stocked++;
+            token->next = tokens;
+            tokens = token;
+            token = NULL;
+            continue;
         }
-        s = strchr(token->string, '\0');
-
-        /* write rand into token */
-        for (len = 0; len < RANDOM_LEN;) {
-            if (random_left == 0) {
-                do
-                    random_left = read(random_fd, random, sizeof random);
-                while (random_left == -1 && errno == EINTR);
-                if (random_left == -1) {
-                    syslog(LOG_ERR,
-                           "%s: read(/dev/urandom) failed: %m", priv->queue_id);
-                    goto failed;
-                } else if (random_left == 0)  {
-                    syslog(LOG_ERR,
-                           "%s: read(/dev/urandom) failed: end of file",
-                           priv->queue_id);
-                    goto failed;
-                }
-            }
 
-            /* draw uniformly-distributed random letter by rejection sampling */
-            random_left--;
-            if (random[random_left] <
-                    UCHAR_MAX - (UCHAR_MAX % sizeof alphabet - 1)) {
-                *s++ = alphabet[random[random_left] % (sizeof alphabet - 1)];
-                len++;
-            }
-        }
-        *s++ = ':';
-
-        /* hash initial part of string */
-        sha1_begin(&hash);
-        sha1_string(&hash, token->string, s - token->string);
-
-        /* iterate counter;
-           always add at least 1 character (assumed by iterate_counter()) */
-        for (len = 1; len <= COUNTER_MAX; len++) {
-            it.counter_last = &counter[len-1];
-            if (iterate_counter(&it, &hash, len - 1))
-                if (it.error)
-                    goto failed;
-                else
-                    goto found;
+        /* take the stamp started early if it's worth enough */
+        for (early = priv->early; early != NULL; early = early->next)
+            if (early->rcpt == local && early->token != NULL &&
+                    early->stamp.bits >= bits && !strcmp(early->date, date))
+                break;
+        if (early != NULL) {
+            token = early->token;
+            early->token = NULL;
+            stamps[started++] = &early->stamp;
+            early_count++;
+        } else {
+            if ((token = begin_token(priv->queue_id, date, local, bits,
+                                     &job->stamps[job->count])) == NULL)
+                goto failed;
+            stamps[started++] = &job->stamps[job->count++];
         }
-        syslog(LOG_ERR, "%s: internal error: COUNTER_MAX(%d) exceeded",
-               priv->queue_id, COUNTER_MAX);
+
+        token->next = tokens;
+        tokens = token;
+        token = NULL;
+    }
+
+    /* let the workers mint all stamps, with the watchdog cancelling the jobs
+       at the deadline, reporting progress while waiting for them */
+    if (pool_submit(job, timeout) == -1) {
+        syslog(LOG_NOTICE, "%s: too much minting queued, %s", priv->queue_id,
+               overflow_tempfail ? "temporarily rejecting message" :
+                                   "accepting message without stamps");
+        free(stamps);
+        free_strings(tokens);
+        cancel_minting(priv);
+        if (!overflow_tempfail)
+            return 0;
+        if (smfi_setreply(ctx, "451", "4.3.2",
+                          "Too busy to add stamps, try again later") ==
+                MI_FAILURE)
+            syslog(LOG_ERR, "%s: smfi_setreply() failed", priv->queue_id);
+        return -1;
+    }
+    memset(&watch, 0, sizeof watch);
+    if (timeout && timeout_cpu)
+        watch.cpu = timeout;
+    else if (timeout) {
+        watch.deadline = ts_start;
+        watch.deadline.tv_sec += timeout;
+    }
+    if (timeout) {
+        watch.progress = report_progress;
+        watch.arg = ctx;
+    }
+    pool_watch(&watch);
+    pool_attach(job, &watch);
+    for (early = priv->early; early != NULL; early = early->next)
+        if (early->token == NULL)
+            pool_attach(&early->job, &watch);
+    done = pool_follow(job, &watch);
+    for (early = priv->early; early != NULL; early = early->next)
+        if (early->token == NULL && !pool_follow(&early->job, &watch))
+            done = 0;
+    pool_unwatch(&watch);
+
+    if (watch.lost) {
+        syslog(LOG_NOTICE, "%s: lost connection to MTA, stopped minting",
+               priv->queue_id);
         goto failed;
+    }
+    if (!done) {
+        /* keep the stamps found so far */
+        for (i = 0, minted = 0; i < started; i++)
+            minted += stamps[i]->found == 1;
+        syslog(LOG_INFO, "%s: spent too long minting, adding %d of %d "
+               "stamps", priv->queue_id, minted, started);
+        if (minted == 0)
+            goto failed;
+    }
+
+    if (pool_clock(&ts) == -1) {
+        syslog(LOG_ERR, "%s: clock_gettime() failed: %m", priv->queue_id);
+        goto failed;
+    }
+
+    /* write the counters, the last stamp being at the head of the list */
+    for (token = tokens, i = started - 1; token != NULL;
+         token = token->next, i--) {
+        if (stamps[i]->found == 0) {
+            /* not found in time */
+            stamps[i] = NULL;
+            continue;
+        } else if (stamps[i]->found != 1) {
+            /* counter exhausted or minting failed */
+            syslog(LOG_ERR, "%s: couldn't mint stamp", priv->queue_id);
+            stamps[i] = NULL;
+            continue;
+        }
 
-        /* found one */
-    found:
-        memcpy(s, counter, len);
-        s[len] = '\0';
+        if (stamps[i] != &ready) {
+            counter_len = mint_counter_len(stamps[i]->bits);
+            s = strchr(token->string, '\0');
+            mint_counter(stamps[i]->counter, counter_len, s);
+            s[counter_len] = '\0';
+        }
 
         /* double-check token */
         if (parse_token(token->string, NULL) == -1 ||
-                token_value(token->string, date, date) < it.bits) {
+                token_value(token->string, date, date) < bits) {
             syslog(LOG_ERR, "%s: internal error: minted incorrect stamp %s",
                    priv->queue_id, token->string);
+            token = NULL;
             goto failed;
         }
 
-        token->next = tokens;
-        tokens = token;
-        token = NULL;
-    }
-
-    if (clock_gettime(CLOCK, &it.ts) == -1) {
-        syslog(LOG_ERR, "%s: clock_gettime() failed: %m", priv->queue_id);
-        goto failed;
+        if (stamps[i] != &ready && priv->message_id != NULL)
+            journal_add(priv->message_id, token->string);
     }
 
     /* now that all tokens have been generated, affix them to the message */
-    for (token = tokens; token != NULL; token = token->next) {
+    for (token = tokens, i = started - 1; token != NULL;
+         token = token->next, i--) {
         size = strlen(token->string);
-        if (size > 998 || (sizeof header_hashcash - 1) + 2 + size > 998)
+        if (stamps[i] == NULL)
+            continue;
+        else if (size > 998 || (sizeof header_hashcash - 1) + 2 + size > 998)
             syslog(LOG_NOTICE,
                    "%s: skipped stamp that exceeds 998 character limit",
                    priv->queue_id);
@@ -722,33 +944,63 @@ void hcfi_eom_mint(SMFICTX* ctx) {
             if (smfi_insheader(ctx, ++priv->hashcash_pos,
                                header_hashcash, token->string) == MI_FAILURE) {
                 syslog(LOG_ERR, "%s: smfi_insheader() failed", priv->queue_id);
+                token = NULL;
                 goto failed;
             }
-            syslog(LOG_INFO,
-                   "%s: added stamp %s", priv->queue_id, token->string);
+            if (stamps[i]->value > stamps[i]->bits)
+                syslog(LOG_INFO, "%s: added stamp %s (found %d bits)",
+                       priv->queue_id, token->string, stamps[i]->value);
+            else
+                syslog(LOG_INFO,
+                       "%s: added stamp %s", priv->queue_id, token->string);
         }
     }
 
-    /* log some statistics */
-    if (tokens != NULL && ts_delta(&it.ts, &it.ts_start) >= 0) {
-        ktries_per_sec = divexp10(it.total_tries + it.tick_tries,
-            (uint64_t)it.ts.tv_sec * 1000000000l + it.ts.tv_nsec, 6);
-        syslog(LOG_INFO,
-            "%s: minting took %ld.%03ld seconds (%ld.%03ld Mhash/s)",
-            priv->queue_id,
-            (long)it.ts.tv_sec, (long)(it.ts.tv_nsec / 1000000l),
-            ktries_per_sec / 1000l, ktries_per_sec % 1000l);
+    /* log some statistics, the rate being unknown for stamps started early */
+    if (reused != 0)
+        syslog(LOG_INFO, "%s: took %d of %d stamps from journal",
+               priv->queue_id, reused, started);
+    if (stocked != 0)
+        syslog(LOG_INFO, "%s: took %d of %d stamps minted ahead",
+               priv->queue_id, stocked, started);
+    if (tokens != NULL && reused + stocked != started &&
+            ts_delta(&ts, &ts_start) >= 0) {
+        if (early_count != 0)
+            syslog(LOG_INFO, "%s: minting took %ld.%03ld seconds "
+                   "(%d of %d stamps started early)", priv->queue_id,
+                   (long)ts.tv_sec, (long)(ts.tv_nsec / 1000000l),
+                   early_count, started);
+        else {
+            ktries_per_sec = divexp10(job->tries,
+                (uint64_t)ts.tv_sec * 1000000000l + ts.tv_nsec, 6);
+            syslog(LOG_INFO,
+                "%s: minting took %ld.%03ld seconds (%ld.%03ld Mhash/s)",
+                priv->queue_id,
+                (long)ts.tv_sec, (long)(ts.tv_nsec / 1000000l),
+                ktries_per_sec / 1000l, ktries_per_sec % 1000l);
+        }
     }
 
+    free(stamps);
     free_strings(tokens);
-    return;
+    cancel_minting(priv);
+    return 0;
 
 failed:
+    free(stamps);
     free(token);
     free_strings(tokens);
+    cancel_minting(priv);
+    return 0;
 }
 
 
+/* A token matching a recipient, valued before checking if it's spent. */
+struct hcfi_stamp {
+    int rcpt;
+    int value;
+};
+
 void hcfi_eom_check(SMFICTX* ctx) {
     /* For each recipient the best stamp is chosen according to the ordering:
            0-160: valid stamp value
@@ -799,146 +1051,83 @@ void hcfi_eom_check(SMFICTX* ctx) {
     char date1[12+1], date2[12+1];
     char buf[998 - ((sizeof header_auth_results - 1) + 2) +
              1 + 1]; /* null, extra byte to detect overflow */
-    int purged = 0;
-    u_int db_flag;
-    DBT db_key, db_value;
-    const char* sep;
-    size_t len;
+    struct spent_key* keys = NULL;
+    struct hcfi_stamp* stamps = NULL;
+    int count = 0, checked = 0, rcpt, rcpts, i;
     int result;
     struct hcfi_priv* priv = smfi_getpriv(ctx);
 
     if (priv->tokens == NULL && !priv->neutral)
         return;
 
+    for (addr = priv->env_rcpts; addr != NULL; addr = addr->next)
+        if (match_address(addr->string, priv->msg_rcpts))
+            for (token = find_token(addr->string, priv->tokens);
+                 token != NULL; token = find_token(addr->string, token->next))
+                count++;
+    if (count != 0 && ((keys = malloc(count * sizeof *keys)) == NULL ||
+                       (stamps = malloc(count * sizeof *stamps)) == NULL)) {
+        syslog(LOG_ERR, "%s: memory allocation failed", priv->queue_id);
+        goto failed;
+    }
+
+    /* value tokens matching each recipient */
+    i = rcpt = 0;
     for (addr = priv->env_rcpts; addr != NULL; addr = addr->next) {
         if (!match_address(addr->string, priv->msg_rcpts))
             continue;
 
-        best = -3; /* no stamps */
-
-        /* iterate over tokens matching this recipient */
-        for (token = find_token(addr->string, priv->tokens); token != NULL;
-             token = find_token(addr->string, token->next)) {
+        for (token = find_token(addr->string, priv->tokens);
+             token != NULL && i < count;
+             token = find_token(addr->string, token->next), i++) {
 
             /* date range */
             if (tt == (time_t)-1) {
                 if ((tt = time(NULL)) == (time_t)-1) {
                     syslog(LOG_ERR, "%s: time() failed", priv->queue_id);
-                    return;
+                    goto failed;
                 }
                 if (format_date(tt, -(28 + 2) * 86400,
                                 date1, sizeof date1 - 1) == -1 ||
                         format_date(tt, 2 * 86400,
                                     date2, sizeof date2 - 1) == -1) {
                     syslog(LOG_ERR, "%s: gmtime_r() failed", priv->queue_id);
-                    return;
+                    goto failed;
                 }
             }
 
-            value = token_value(token->string, date1, date2);
+            stamps[i].rcpt = rcpt;
+            stamps[i].value = token_value(token->string, date1, date2);
+            keys[i].key = NULL;
 
             /* check double-spend database */
-            if (db_spent != NULL && value >= check_bits) {
+            if (spent_count != 0 && stamps[i].value >= check_bits) {
                 /* mangle token for storing in database;
                    this is done in-place, but we should not access this token
                    again because all envelope recipients in the list are
                    distinct */
                 token_truncate(token->string);
+                keys[i].key = token->string;
+                checked = 1;
+            }
+        }
+        rcpt++;
+    }
+    count = i;
+    rcpts = rcpt;
 
-                memset(&db_key, 0, sizeof db_key);
-                memset(&db_value, 0, sizeof db_value);
-
-                if (pthread_mutex_lock(&db_mutex) != 0)
-                    syslog(LOG_WARNING, "%s: pthread_mutex_lock() failed, "
-                           "double-spend database will not be checked",
-                           priv->queue_id);
-                else {
-                    /* purge expired stamps */
-                    if (!purged) {
-                        purged = 1;
-
-                        /* don't purge around the turn of the century */
-                        if (strcmp(date1, date2) > 0)
-                            goto purge_done;
-
-                        for (db_flag = R_FIRST;;) {
-                            switch (db_spent->seq(db_spent, &db_key, &db_value,
-                                                  db_flag)) {
-                            case -1:
-                                syslog(LOG_WARNING, "%s: db->seq() failed: %m; "
-                                       "expired stamps will not be purged from "
-                                       "double-spend database", priv->queue_id);
-                            case 1:
-                                goto purge_done;
-                            }
-                            sep = memchr(db_key.data, ':', db_key.size);
-                            len = sep != NULL ?
-                                      (size_t)(sep - (const char*)db_key.data) :
-                                      db_key.size;
-                            if (db_flag == R_FIRST) {
-                                if (len > sizeof date1 - 1)
-                                    len = sizeof date1 - 1;
-                                if (len >= 6 &&
-                                        memcmp(db_key.data, date1, len) >= 0) {
-                                    db_flag = R_LAST;
-                                    continue;
-                                }
-                            } else {
-                                if (len > sizeof date2 - 1)
-                                    len = sizeof date2 - 1;
-                                if (len >= 6 &&
-                                        memcmp(db_key.data, date2, len) <= 0)
-                                    break;
-                            }
-                            switch (db_spent->del(db_spent, &db_key,
-                                                  R_CURSOR)) {
-                            case -1:
-                                syslog(LOG_WARNING, "%s: db->del() failed: %m; "
-                                       "expired stamps will not be purged from "
-                                       "double-spend database", priv->queue_id);
-                                goto purge_done;
-                            case 1:
-                                syslog(LOG_ERR, "%s: internal error: "
-                                       "key not found in double-spend database",
-                                       priv->queue_id);
-                                goto purge_done;
-                            }
-                        }
-                    purge_done:
-                        memset(&db_key, 0, sizeof db_key);
-                        memset(&db_value, 0, sizeof db_value);
-                    }
-
-                    /* record current stamp */
-                    db_key.data = token->string;
-                    db_key.size = strlen(token->string);
-                    db_value.data = "";
-                    db_value.size = 0;
-
-                    switch (db_spent->put(db_spent, &db_key, &db_value,
-                                          R_NOOVERWRITE)) {
-                    case 1:
-                        value = -4;
-                        break;
-                    case -1:
-                        syslog(LOG_WARNING, "%s: db->put() failed: %m; "
-                               "double-spend database will not be checked",
-                               priv->queue_id);
-                    }
+    /* look up and record the stamps of all recipients at once */
+    if (checked)
+        spent_check(keys, count, priv->queue_id);
 
-                    /* sync to disk every 5 minutes */
-                    if (db_sync == 0 || tt >= db_sync) {
-                        if (db_sync != 0 && db_spent->sync(db_spent, 0) == -1)
-                            syslog(LOG_WARNING,
-                                   "%s: db->sync() failed: %m", priv->queue_id);
-                        db_sync = tt + 300;
-                    }
+    i = 0;
+    for (rcpt = 0; rcpt < rcpts; rcpt++) {
+        best = -3; /* no stamps */
 
-                    if (pthread_mutex_unlock(&db_mutex) != 0)
-                        syslog(LOG_WARNING, "%s: pthread_mutex_unlock() failed",
-                               priv->queue_id);
-                }
-            }
+        for (; i < count && stamps[i].rcpt == rcpt; i++) {
+            value = stamps[i].value;
+            if (keys[i].key != NULL && keys[i].spent == 1)
+                value = -4;
 
             /* out of multiple tokens for a recipient we select the best one */
             if (best < value || best == -3)
@@ -950,6 +1139,8 @@ void hcfi_eom_check(SMFICTX* ctx) {
         if (max_value < best)
             max_value = best;
     }
+    free(keys);
+    free(stamps);
 
     if (priv->my_hostname == NULL) {
         syslog(LOG_WARNING, "%s: local hostname not supplied by MTA, "
@@ -995,6 +1186,11 @@ void hcfi_eom_check(SMFICTX* ctx) {
     if (smfi_insheader(ctx, ++priv->auth_results_pos,
                         header_auth_results, buf) == MI_FAILURE)
         syslog(LOG_ERR, "%s: smfi_insheader() failed", priv->queue_id);
+    return;
+
+failed:
+    free(keys);
+    free(stamps);
 }
 
 
@@ -1006,11 +1202,15 @@ sfsistat hcfi_eom(SMFICTX* ctx) {
     get_syms(ctx);
 
     if (!priv->ignore)
-        if (priv->mode == 1)
-            hcfi_eom_mint(ctx);
-        else if (priv->mode == 2)
+        if (priv->mode == 1) {
+            if (hcfi_eom_mint(ctx) == -1)
+                return SMFIS_TEMPFAIL;
+        } else if (priv->mode == 2)
             hcfi_eom_check(ctx);
 
+    /* stamps started early for a message that turned out not to need them */
+    cancel_minting(priv);
+
     if (priv->mode != 1)
         for (pos = priv->remove_auth_results; pos != NULL; pos = pos->next)
             if (smfi_chgheader(ctx, header_auth_results, pos->integer,
@@ -1027,13 +1227,24 @@ sfsistat hcfi_eom(SMFICTX* ctx) {
     return SMFIS_ACCEPT;
 }
 
+sfsistat hcfi_abort(SMFICTX* ctx) {
+    struct hcfi_priv* priv = smfi_getpriv(ctx);
+
+    if (priv != NULL)
+        cancel_minting(priv);
+    return SMFIS_CONTINUE;
+}
+
 sfsistat hcfi_close(SMFICTX* ctx) {
     struct hcfi_priv* priv = smfi_getpriv(ctx);
 
     if (priv != NULL) {
+        cancel_minting(priv);
         if (priv->queue_id != null_queue_id)
             free(priv->queue_id);
         free(priv->my_hostname);
+        free(priv->sender);
+        free(priv->message_id);
         free_strings(priv->env_rcpts);
         free_strings(priv->msg_rcpts);
         free_strings(priv->tokens);
@@ -1062,8 +1273,8 @@ sfsistat hcfi_negotiate(SMFICTX* ctx, unsigned long f0, unsigned long f1,
 
     if (f0 & SMFIF_SETSYMLIST) {
         *pf0 |= SMFIF_SETSYMLIST;
-        if (smfi_setsymlist(ctx,
-                            SMFIM_ENVFROM, "i j {auth_type}") == MI_FAILURE |
+        if (smfi_setsymlist(ctx, SMFIM_ENVFROM,
+                            "i j {auth_type} {auth_authen}") == MI_FAILURE |
                 smfi_setsymlist(ctx, SMFIM_ENVRCPT, "i j") == MI_FAILURE |
                 smfi_setsymlist(ctx, SMFIM_EOM, "i j") == MI_FAILURE)
             syslog(LOG_ERR, "smfi_setsymlist() failed");
@@ -1083,7 +1294,7 @@ struct smfiDesc milter = {
     NULL,
     NULL,
     hcfi_eom,
-    NULL,
+    hcfi_abort,
     hcfi_close,
     NULL,
     NULL,
@@ -1095,8 +1306,16 @@ const char* usage_short =
 "Hashcash Milter 0.1.3\n"
 "Usage: hashcash-milter -p socket [-f] [-P pidfile]\n"
 "                      [-u user[:group] [-C rootdir]]\n"
-"                      [-a] [-i addr] [-c bits [-d datafile]]\n"
-"                      [-m bits [-r bits] [-s dom] [-t sec]]\n";
+"                      [-a] [-i addr]\n"
+"                      [-c bits [-d datafile [-D shards] [-E stamps|-y] |\n"
+"                                -d datafile -H stamps]]\n"
+"                      [-m bits|-l sec [-r bits] [-b bits] [-s dom] [-t sec]\n"
+"                       [-T] [-e] [-j journal] [-k rcpts] [-w workers]\n"
+"                       [-n class] [-g cpus] [-x] [-S socket]\n"
+"                       [-R peers -K keyfile] [-q jobs] [-o policy]]\n"
+"       hashcash-milter -W port@address -K keyfile [-f] [-P pidfile]\n"
+"                      [-u user[:group] [-C rootdir]]\n"
+"                      [-w workers] [-n class] [-g cpus] [-x] [-q jobs]\n";
 
 const char* usage_more =
 "-p  listening socket:\n"
@@ -1111,26 +1330,61 @@ const char* usage_more =
 "-i  mail sent from comma-separated IP addresses or networks is outgoing\n"
 "-c  check tokens on incoming messages with given minimum value\n"
 "-d  storage for spent stamps (relative to rootdir)\n"
+"-D  split storage for spent stamps into given number of files\n"
+"-E  purge at most given number of expired spent stamps per second\n"
+"      (default 1000)\n"
+"-y  keep spent stamps in a file for each day in the -d directory\n"
+"-H  keep spent stamps in a hash table sized for given number of them\n"
 "-m  mint tokens for outgoing messages with given value\n"
+"-l  reduce token value to what can be minted in given number of seconds\n"
+"      (up to -m bits, if given)\n"
 "-r  reduce token value for multiple recipients to given minimum\n"
+"-b  reduce token value under load to given minimum\n"
 "-s  cover only mail sent from comma-separated domains\n"
-"-t  maximum number of seconds to spend per message\n";
+"-t  maximum number of seconds to spend per message\n"
+"-T  count -t in seconds of a minting thread's time rather than elapsed time\n"
+"-e  start minting as soon as recipients are seen in the headers\n"
+"-j  journal of minted stamps (relative to rootdir), or '' to keep it\n"
+"      in memory\n"
+"-k  mint stamps ahead of time for up to given number of frequent recipients\n"
+"-w  number of minting threads (default is one per processor)\n"
+"-n  scheduling class of minting threads: idle, batch or a nice value 1-19\n"
+"-g  run minting threads on comma-separated CPUs or ranges, e.g. 0-3,8\n"
+"-x  mint in a separate process for each minting thread\n"
+"-S  take requests for stamps from local programs on a UNIX socket\n"
+"      (relative to rootdir)\n"
+"-R  also mint on comma-separated remote workers given as port@host\n"
+"-W  run as a remote worker minting for other milters on port@address\n"
+"-K  file with the key shared with remote workers\n"
+"-q  maximum number of messages, service and remote requests being minted or\n"
+"      waiting (stamps started early by -e aren't counted)\n"
+"-o  when minting would take longer than -t or -q is reached:\n"
+"      accept    accept message without stamps (default)\n"
+"      tempfail  reject message with a temporary failure\n";
 
 
 int main(int argc, char* argv[]) {
     int opt;
-    int daemonize = 1;
-    int status, pidfile_fd = -1, db_fd, null_fd = -1;
+    int daemonize = 1, overflow = 0, daily = 0;
+    int status, pidfile_fd = -1, null_fd = -1, shards = 0;
+    long purge_rate = 0, table = 0;
     long bits;
     char *arg, *end;
     char *sockfile = NULL, *user = NULL, *group = NULL, *rootdir = NULL,
-         *pidfile = NULL, *datafile = NULL;
-    BTREEINFO db_info;
+         *pidfile = NULL, *datafile = NULL, *journal = NULL, *sched = NULL,
+         *cpus = NULL, *service = NULL, *peers = NULL, *remote = NULL,
+         *keyfile = NULL;
+    const char* mint_kernel_name;
 
     if (sha1_check() == -1)
         errx(EXIT_FAILURE, "internal error: SHA-1 library check failed");
+    mint_kernel_name = mint_setup();
+    if (mint_check() == -1)
+        errx(EXIT_FAILURE, "internal error: SHA-1 minting kernel check failed");
 
-    while ((opt = getopt(argc, argv, ":p:fP:u:C:ai:c:d:m:r:s:t:h")) != -1)
+    while ((opt = getopt(argc, argv,
+                         ":p:fP:u:C:ai:c:d:D:E:yH:"
+                         "m:l:r:b:s:t:Tej:k:w:n:g:xS:R:W:K:q:o:h")) != -1)
         switch (opt) {
         case 'p':
             if (sockfile != NULL)
@@ -1182,6 +1436,34 @@ int main(int argc, char* argv[]) {
                 goto once;
             datafile = strdup_checked(optarg);
             break;
+        case 'D':
+            bits = strtol(optarg, &end, 10);
+            if (shards != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > SPENT_SHARDS_MAX)
+                goto invalid;
+            shards = bits;
+            break;
+        case 'E':
+            bits = strtol(optarg, &end, 10);
+            if (purge_rate != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > 1000000)
+                goto invalid;
+            purge_rate = bits;
+            break;
+        case 'y':
+            if (daily++)
+                goto once;
+            break;
+        case 'H':
+            bits = strtol(optarg, &end, 10);
+            if (table != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > 1l << 28)
+                goto invalid;
+            table = bits;
+            break;
         case 'm':
             bits = strtol(optarg, &end, 10);
             if (mint_bits != 0)
@@ -1198,6 +1480,14 @@ int main(int argc, char* argv[]) {
                 goto invalid;
             reduce_bits = bits;
             break;
+        case 'b':
+            bits = strtol(optarg, &end, 10);
+            if (load_bits != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > 160)
+                goto invalid;
+            load_bits = bits;
+            break;
         case 's':
             if (cover_domains != NULL)
                 goto once;
@@ -1212,6 +1502,93 @@ int main(int argc, char* argv[]) {
             if (*end || timeout <= 0)
                 goto invalid;
             break;
+        case 'l':
+            if (latency != 0)
+                goto once;
+            latency = strtol(optarg, &end, 10);
+            if (*end || latency <= 0)
+                goto invalid;
+            break;
+        case 'T':
+            if (timeout_cpu++)
+                goto once;
+            break;
+        case 'e':
+            if (mint_early++)
+                goto once;
+            break;
+        case 'j':
+            if (journal != NULL)
+                goto once;
+            journal = strdup_checked(optarg);
+            break;
+        case 'k':
+            bits = strtol(optarg, &end, 10);
+            if (premint_max != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > INT_MAX)
+                goto invalid;
+            premint_max = bits;
+            break;
+        case 'w':
+            bits = strtol(optarg, &end, 10);
+            if (mint_workers != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > 1024)
+                goto invalid;
+            mint_workers = bits;
+            break;
+        case 'n':
+            if (sched != NULL)
+                goto once;
+            sched = optarg;
+            break;
+        case 'g':
+            if (cpus != NULL)
+                goto once;
+            cpus = optarg;
+            break;
+        case 'x':
+            if (pool_processes++)
+                goto once;
+            break;
+        case 'S':
+            if (service != NULL)
+                goto once;
+            service = strdup_checked(optarg);
+            break;
+        case 'R':
+            if (peers != NULL)
+                goto once;
+            peers = optarg;
+            break;
+        case 'W':
+            if (remote != NULL)
+                goto once;
+            remote = optarg;
+            break;
+        case 'K':
+            if (keyfile != NULL)
+                goto once;
+            keyfile = optarg;
+            break;
+        case 'q':
+            bits = strtol(optarg, &end, 10);
+            if (pool_queue_max != 0)
+                goto once;
+            if (*end || bits <= 0 || bits > INT_MAX)
+                goto invalid;
+            pool_queue_max = bits;
+            break;
+        case 'o':
+            if (overflow)
+                goto once;
+            overflow = 1;
+            if (!strcmp(optarg, "tempfail"))
+                overflow_tempfail = 1;
+            else if (strcmp(optarg, "accept"))
+                goto invalid;
+            break;
         case 'h':
             printf("%s\n%s\n", usage_short, usage_more);
             return EXIT_SUCCESS;
@@ -1229,32 +1606,76 @@ int main(int argc, char* argv[]) {
             errx(EXIT_FAILURE, "-%c value is invalid", (char)opt);
         }
 
-    if (sockfile == NULL) {
+    if (remote != NULL &&
+            (sockfile != NULL || check_bits != 0 || mint_bits != 0 ||
+             latency != 0))
+        errx(EXIT_FAILURE, "-W can't be specified with -p, -c, -m or -l");
+    if (sockfile == NULL && remote == NULL) {
         if (argc == 1)
             goto usage;
         errx(EXIT_FAILURE, "-p must be specified");
     }
     if (check_bits == 0 && datafile != NULL)
         errx(EXIT_FAILURE, "-d can't be specified without -c");
-    if (mint_bits != 0 && !cover_auth && cover_ipaddrs == NULL)
-        errx(EXIT_FAILURE, "either -a or -i must be specified with -m");
-    if (mint_bits == 0 &&
-            (reduce_bits != 0 || cover_domains != NULL || timeout != 0))
-        errx(EXIT_FAILURE, "-r, -s and -t can't be specified without -m");
-    if (reduce_bits > mint_bits)
+    if (datafile == NULL &&
+            (shards != 0 || purge_rate != 0 || daily || table != 0))
+        errx(EXIT_FAILURE, "-D, -E, -y and -H can't be specified without -d");
+    if (daily && purge_rate != 0)
+        errx(EXIT_FAILURE, "-E can't be specified with -y");
+    if (table != 0 && (shards != 0 || purge_rate != 0 || daily))
+        errx(EXIT_FAILURE, "-D, -E and -y can't be specified with -H");
+    if (purge_rate != 0)
+        spent_rate = purge_rate;
+    if ((mint_bits != 0 || latency != 0) && !cover_auth &&
+            cover_ipaddrs == NULL)
+        errx(EXIT_FAILURE, "either -a or -i must be specified with -m or -l");
+    if (mint_bits == 0 && latency == 0 &&
+            (reduce_bits != 0 || load_bits != 0 || cover_domains != NULL ||
+             timeout != 0 || timeout_cpu || mint_early || journal != NULL ||
+             premint_max != 0 || service != NULL || peers != NULL ||
+             overflow))
+        errx(EXIT_FAILURE, "-r, -b, -s, -t, -T, -e, -j, -k, -S, -R and -o "
+             "can't be specified without -m or -l");
+    if (mint_bits == 0 && latency == 0 && remote == NULL &&
+            (mint_workers != 0 || sched != NULL || cpus != NULL ||
+             pool_processes || pool_queue_max != 0))
+        errx(EXIT_FAILURE, "-w, -n, -g, -x and -q can't be specified without "
+             "-m, -l or -W");
+    if ((peers != NULL || remote != NULL) != (keyfile != NULL))
+        errx(EXIT_FAILURE, "-K must be specified with -R or -W, and only "
+             "with them");
+    if (peers != NULL && remote_add_peers(peers) == -1)
+        errx(EXIT_FAILURE, "-R value is invalid");
+    if (timeout_cpu && timeout == 0)
+        errx(EXIT_FAILURE, "-T can't be specified without -t");
+    if (sched != NULL && pool_set_sched(sched) == -1)
+        errx(EXIT_FAILURE, errno == ENOSYS ? "-n isn't supported on this "
+             "system" : "-n value is invalid");
+    if (cpus != NULL && pool_set_cpus(cpus) == -1)
+        errx(EXIT_FAILURE, errno == ENOSYS ? "-g isn't supported on this "
+             "system" : "-g value is invalid");
+    if (mint_bits != 0 && reduce_bits > mint_bits)
         errx(EXIT_FAILURE, "-r bits must be no greater than -m bits");
-    if (mint_bits == 0 && check_bits == 0)
-        errx(EXIT_FAILURE, "either -c or -m must be specified");
+    if (mint_bits != 0 && load_bits > mint_bits)
+        errx(EXIT_FAILURE, "-b bits must be no greater than -m bits");
+    if (mint_bits == 0 && latency == 0 && check_bits == 0 && remote == NULL)
+        errx(EXIT_FAILURE, "either -c, -m or -l must be specified");
+    if (mint_bits == 0 && latency != 0)
+        mint_bits = 160;
     if (rootdir != NULL && user == NULL)
         errx(EXIT_FAILURE, "-C must be specified with -u");
 
     /* set up before dropping privileges */
-    do
-        random_fd = open("/dev/urandom", O_RDONLY);
-    while (random_fd == -1 && errno == EINTR);
-    if (random_fd == -1)
+    if (entropy_open() == -1)
         err(EXIT_FAILURE, "open(/dev/urandom) failed");
 
+    if (keyfile != NULL && remote_read_key(keyfile) == -1) {
+        if (errno == EINVAL)
+            errx(EXIT_FAILURE, "key in %s must be one line of 16 to 1023 "
+                 "characters", keyfile);
+        err(EXIT_FAILURE, "couldn't read key from %s", keyfile);
+    }
+
     if (daemonize) {
         do
             null_fd = open("/dev/null", O_RDWR);
@@ -1281,6 +1702,9 @@ int main(int argc, char* argv[]) {
             err(EXIT_FAILURE, "fcntl(F_SETFD) failed");
     }
 
+    if (load_bits != 0 && load_open() == -1)
+        syslog(LOG_INFO, "CPU pressure information not available: %m");
+
     /* drop privileges and change root */
     if (rootdir != NULL)
         chuid(*user ? user : NULL, group, rootdir);
@@ -1290,42 +1714,49 @@ int main(int argc, char* argv[]) {
         if (rootdir != NULL)
             rootdir_path(datafile, rootdir);
 
-        if ((status = pthread_mutex_init(&db_mutex, NULL)) != 0)
-            errx(EXIT_FAILURE,
-                 "pthread_mutex_init() failed: %s", strerror(status));
+        if (spent_open(datafile, shards != 0 ? shards : 1, daily,
+                       table) == -1) {
+            if (errno == EWOULDBLOCK) /* opportunistic locking */
+                errx(EXIT_FAILURE, "datafile %s is locked", datafile);
+            if (errno == EINVAL && table != 0)
+                errx(EXIT_FAILURE, "datafile %s is not a table of the size "
+                     "given by -H", datafile);
+            err(EXIT_FAILURE, "couldn't open datafile %s", datafile);
+        }
+    }
 
-        memset(&db_info, 0, sizeof db_info);
-        db_info.minkeypage = 8;
-        db_info.compare = NULL;
-        db_info.prefix = NULL;
-        do
-            db_spent = dbopen(datafile, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
-                              DB_BTREE, &db_info);
-        while (db_spent == NULL && errno == EINTR);
-        if (db_spent == NULL)
-            err(EXIT_FAILURE, "dbopen() failed");
-        if ((db_fd = db_spent->fd(db_spent)) == -1)
-            err(EXIT_FAILURE, "db->fd() failed");
-        do
-            status = flock(db_fd, LOCK_EX | LOCK_NB);
-        while (status == -1 && errno == EINTR);
-        if (status == -1 && errno == EWOULDBLOCK) /* opportunistic locking */
-            errx(EXIT_FAILURE, "datafile %s is locked", datafile);
-        if (fcntl(db_fd, F_SETFD, FD_CLOEXEC) == -1)
-            err(EXIT_FAILURE, "fcntl(F_SETFD, FD_CLOEXEC) failed");
+    /* an empty name keeps the journal in memory */
+    if (journal != NULL) {
+        if (*journal && rootdir != NULL)
+            rootdir_path(journal, rootdir);
+        if (journal_open(*journal ? journal : NULL) == -1)
+            err(EXIT_FAILURE, "couldn't open journal %s",
+                *journal ? journal : "in memory");
     }
 
-    if (rootdir != NULL && !strncmp(sockfile, "local:", 6))
-        rootdir_path(sockfile + 6, rootdir);
+    if (service != NULL) {
+        if (rootdir != NULL)
+            rootdir_path(service, rootdir);
+        if (service_open(service) == -1)
+            err(EXIT_FAILURE, "couldn't open service socket %s", service);
+    }
 
-    if (smfi_register(milter) == MI_FAILURE)
-        errx(EXIT_FAILURE, "smfi_register() failed");
+    if (remote != NULL) {
+        if (remote_listen(remote) == -1)
+            err(EXIT_FAILURE, "couldn't listen on %s", remote);
+    } else {
+        if (rootdir != NULL && !strncmp(sockfile, "local:", 6))
+            rootdir_path(sockfile + 6, rootdir);
 
-    if (smfi_setconn(sockfile) == MI_FAILURE)
-        errx(EXIT_FAILURE, "smfi_setconn(%s) failed", sockfile);
+        if (smfi_register(milter) == MI_FAILURE)
+            errx(EXIT_FAILURE, "smfi_register() failed");
 
-    if (smfi_opensocket(1) == MI_FAILURE)
-        errx(EXIT_FAILURE, "smfi_opensocket(%s) failed", sockfile);
+        if (smfi_setconn(sockfile) == MI_FAILURE)
+            errx(EXIT_FAILURE, "smfi_setconn(%s) failed", sockfile);
+
+        if (smfi_opensocket(1) == MI_FAILURE)
+            errx(EXIT_FAILURE, "smfi_opensocket(%s) failed", sockfile);
+    }
 
     /* run daemon */
     if (daemonize && daemon(0, 1) == -1)
@@ -1338,11 +1769,69 @@ int main(int argc, char* argv[]) {
         if (!daemonize)
             err(EXIT_FAILURE, "write(%s) failed", pidfile);
 
-    syslog(LOG_INFO, "hashcash-milter 0.1.3 started");
-    status = smfi_main();
+    /* threads don't survive daemon() */
+    if (datafile != NULL && spent_start() == -1) {
+        syslog(LOG_ERR, "couldn't start purging spent stamps: %m");
+        if (!daemonize)
+            err(EXIT_FAILURE, "couldn't start purging spent stamps");
+        return EXIT_FAILURE;
+    }
+
+    if ((mint_bits != 0 || remote != NULL) &&
+            pool_start(mint_workers) == -1) {
+        syslog(LOG_ERR, "couldn't start minting workers: %m");
+        if (!daemonize)
+            err(EXIT_FAILURE, "couldn't start minting workers");
+        return EXIT_FAILURE;
+    }
+
+    /* the backlog is high if it takes a good part of the time allowed */
+    if (mint_bits != 0 &&
+            load_start(latency ? latency : timeout ? timeout / 2.0 :
+                                                     LOAD_BACKLOG,
+                       load_bits != 0 ? mint_bits - load_bits : 0) == -1) {
+        syslog(LOG_ERR, "couldn't start following minting load: %m");
+        if (!daemonize)
+            err(EXIT_FAILURE, "couldn't start following minting load");
+        return EXIT_FAILURE;
+    }
+
+    if (premint_max != 0 &&
+            premint_start(premint_value, premint_token) == -1) {
+        syslog(LOG_ERR, "couldn't start minting ahead: %m");
+        if (!daemonize)
+            err(EXIT_FAILURE, "couldn't start minting ahead");
+        return EXIT_FAILURE;
+    }
+
+    if (service != NULL && service_start(mint_bits, service_token) == -1) {
+        syslog(LOG_ERR, "couldn't start minting service: %m");
+        if (!daemonize)
+            err(EXIT_FAILURE, "couldn't start minting service");
+        return EXIT_FAILURE;
+    }
+
+    if ((peers != NULL && remote_start() == -1) ||
+            (remote != NULL && remote_serve() == -1)) {
+        syslog(LOG_ERR, "couldn't start remote minting: %m");
+        if (!daemonize)
+            err(EXIT_FAILURE, "couldn't start remote minting");
+        return EXIT_FAILURE;
+    }
+
+    syslog(LOG_INFO, "hashcash-milter 0.1.3 started%s",
+           remote != NULL ? " as remote worker" : "");
+    if (mint_bits != 0 || remote != NULL)
+        syslog(LOG_INFO, "using %s minting kernel in %d workers%s",
+               mint_kernel_name, pool_workers,
+               pool_processes ? " with separate processes" : "");
+    status = remote != NULL ? remote_wait() : smfi_main();
 
     /* clean up */
-    if (datafile != NULL && db_spent->close(db_spent) == -1)
+    if (spent_close() == -1)
+        if (!daemonize)
+            err(EXIT_FAILURE, "db->close() failed");
+    if (journal_close() == -1)
         if (!daemonize)
             err(EXIT_FAILURE, "db->close() failed");
 
@@ -0,0 +1,623 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mint.h"
+#include "util.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef USE_SIMD
+#include <immintrin.h>
+#endif
+
+
+#define V uint32_t
+#define VLOAD(p) (*(p))
+#define VSTORE(p, x) (*(p) = (x))
+#define VSET1(x) ((uint32_t)(x))
+#define VADD(x, y) ((x) + (y))
+#define VXOR(x, y) ((x) ^ (y))
+#define VAND(x, y) ((x) & (y))
+#define VOR(x, y) ((x) | (y))
+#define VROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+#define VSHR(x, n) ((x) >> (n))
+#define VZERO(x) ((x) == 0)
+#define KERNEL_SUFFIX scalar
+#define KERNEL_TARGET
+#include "kernel.h"
+
+#ifdef USE_SIMD
+
+#define V __m128i
+#define VLOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define VSTORE(p, x) _mm_storeu_si128((__m128i*)(p), x)
+#define VSET1(x) _mm_set1_epi32((int)(x))
+#define VADD(x, y) _mm_add_epi32(x, y)
+#define VXOR(x, y) _mm_xor_si128(x, y)
+#define VAND(x, y) _mm_and_si128(x, y)
+#define VOR(x, y) _mm_or_si128(x, y)
+#define VROL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32-(n)))
+#define VSHR(x, n) _mm_srl_epi32(x, _mm_cvtsi32_si128(n))
+#define VZERO(x) _mm_movemask_ps(_mm_castsi128_ps( \
+    _mm_cmpeq_epi32(x, _mm_setzero_si128())))
+#define KERNEL_SUFFIX sse2
+#define KERNEL_TARGET __attribute__((target("sse2")))
+#include "kernel.h"
+
+#define V __m256i
+#define VLOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define VSTORE(p, x) _mm256_storeu_si256((__m256i*)(p), x)
+#define VSET1(x) _mm256_set1_epi32((int)(x))
+#define VADD(x, y) _mm256_add_epi32(x, y)
+#define VXOR(x, y) _mm256_xor_si256(x, y)
+#define VAND(x, y) _mm256_and_si256(x, y)
+#define VOR(x, y) _mm256_or_si256(x, y)
+#define VROL(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32-(n)))
+#define VSHR(x, n) _mm256_srl_epi32(x, _mm_cvtsi32_si128(n))
+#define VZERO(x) _mm256_movemask_ps(_mm256_castsi256_ps( \
+    _mm256_cmpeq_epi32(x, _mm256_setzero_si256())))
+#define KERNEL_SUFFIX avx2
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#include "kernel.h"
+
+#define V __m512i
+#define VLOAD(p) _mm512_loadu_si512((const void*)(p))
+#define VSTORE(p, x) _mm512_storeu_si512((void*)(p), x)
+#define VSET1(x) _mm512_set1_epi32((int)(x))
+#define VADD(x, y) _mm512_add_epi32(x, y)
+#define VXOR(x, y) _mm512_xor_si512(x, y)
+#define VAND(x, y) _mm512_and_si512(x, y)
+#define VOR(x, y) _mm512_or_si512(x, y)
+#define VROL(x, n) _mm512_rol_epi32(x, n)
+#define VSHR(x, n) _mm512_srl_epi32(x, _mm_cvtsi32_si128(n))
+#define VZERO(x) (int)_mm512_testn_epi32_mask(x, x)
+#define VCH(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xca)
+#define VPARITY(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define VMAJ(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xe8)
+#define KERNEL_SUFFIX avx512
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#include "kernel.h"
+
+int supported_sse2() {
+    return __builtin_cpu_supports("sse2");
+}
+
+int supported_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+int supported_avx512() {
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif /* USE_SIMD */
+
+#ifdef USE_SHA_NI
+
+#include "sha1ni.h"
+
+/* The SHA extensions compute one candidate at a time, so this kernel runs four
+   independent candidates for the out-of-order core to overlap. Word 12 starts
+   a group of four rounds, so each candidate starts from the registers before
+   word 12, and the schedule words before it are shared. */
+SHA_TARGET __attribute__((always_inline))
+static inline void mint_rounds_shani(const struct mint_block* m,
+                                     const __m128i* shared, uint32_t word,
+                                     __m128i* abcd_out, __m128i* e_out) {
+    __m128i abcd, e[2], msg[4];
+
+    msg[0] = shared[0];
+    msg[1] = shared[1];
+    msg[2] = shared[2];
+    msg[3] = _mm_set_epi32(m->data[12], word, m->data[14], m->data[15]);
+
+    abcd = _mm_set_epi32(m->state12[0], m->state12[1], m->state12[2],
+                         m->state12[3]);
+    e[1] = _mm_add_epi32(_mm_set_epi32(m->state12[4], 0, 0, 0), msg[3]);
+    e[0] = abcd;
+    msg[0] = _mm_sha1msg2_epu32(msg[0], msg[3]);
+    abcd = _mm_sha1rnds4_epu32(abcd, e[1], 0);
+    msg[2] = _mm_sha1msg1_epu32(msg[2], msg[3]);
+    msg[1] = _mm_xor_si128(msg[1], msg[3]);
+
+    SHA_GROUP(4,  abcd, e, msg)
+    SHA_GROUP(5,  abcd, e, msg)
+    SHA_GROUP(6,  abcd, e, msg)
+    SHA_GROUP(7,  abcd, e, msg)
+    SHA_GROUP(8,  abcd, e, msg)
+    SHA_GROUP(9,  abcd, e, msg)
+    SHA_GROUP(10, abcd, e, msg)
+    SHA_GROUP(11, abcd, e, msg)
+    SHA_GROUP(12, abcd, e, msg)
+    SHA_GROUP(13, abcd, e, msg)
+    SHA_GROUP(14, abcd, e, msg)
+    SHA_GROUP(15, abcd, e, msg)
+    SHA_GROUP(16, abcd, e, msg)
+    SHA_GROUP(17, abcd, e, msg)
+    SHA_GROUP(18, abcd, e, msg)
+    SHA_GROUP(19, abcd, e, msg)
+
+    *abcd_out = _mm_add_epi32(abcd, SHA_LOAD(m->digest));
+    *e_out = _mm_sha1nexte_epu32(e[0],
+                                 _mm_set_epi32(m->digest[4], 0, 0, 0));
+}
+
+/* Schedule words of the first three groups as they stand before group 3. */
+SHA_TARGET __attribute__((always_inline))
+static inline void mint_shared_shani(const struct mint_block* m,
+                                     __m128i* shared) {
+    __m128i w0 = SHA_LOAD(&m->data[0]), w1 = SHA_LOAD(&m->data[4]),
+            w2 = SHA_LOAD(&m->data[8]);
+
+    shared[0] = _mm_xor_si128(_mm_sha1msg1_epu32(w0, w1), w2);
+    shared[1] = _mm_sha1msg1_epu32(w1, w2);
+    shared[2] = w2;
+}
+
+SHA_TARGET
+void mint_final_shani(const struct mint_block* m, const uint32_t* words,
+                      struct mint_lanes* x) {
+    __m128i shared[3], abcd, e;
+    uint32_t digest[4];
+    int l, i;
+
+    mint_shared_shani(m, shared);
+    for (l = 0; l < 4; l++) {
+        mint_rounds_shani(m, shared, words[l], &abcd, &e);
+        _mm_storeu_si128((__m128i*)digest, _mm_shuffle_epi32(abcd, 0x1b));
+        for (i = 0; i < 4; i++)
+            x->digest[i][l] = digest[i];
+        x->digest[4][l] = _mm_extract_epi32(e, 3);
+    }
+}
+
+SHA_TARGET
+int mint_test_shani(const struct mint_block* m, const uint32_t* words,
+                    int bits) {
+    __m128i shared[3], abcd[4], e[4];
+    int l, mask = 0;
+
+    mint_shared_shani(m, shared);
+    for (l = 0; l < 4; l++)
+        mint_rounds_shani(m, shared, words[l], &abcd[l], &e[l]);
+    for (l = 0; l < 4; l++)
+        if (!((uint32_t)_mm_extract_epi32(abcd[l], 3) >> (32 - bits)))
+            mask |= 1 << l;
+    return mask;
+}
+
+SHA_TARGET
+int mint_test_wide_shani(const struct mint_block* m, const uint32_t* words,
+                         int bits) {
+    __m128i shared[3], abcd[4], e[4];
+    int l, mask = 0;
+
+    mint_shared_shani(m, shared);
+    for (l = 0; l < 4; l++)
+        mint_rounds_shani(m, shared, words[l], &abcd[l], &e[l]);
+    for (l = 0; l < 4; l++)
+        if (!_mm_extract_epi32(abcd[l], 3) &&
+                !((uint32_t)_mm_extract_epi32(abcd[l], 2) >>
+                  (bits < 64 ? 64 - bits : 0)))
+            mask |= 1 << l;
+    return mask;
+}
+
+int supported_shani() {
+    return sha1_ni_supported();
+}
+
+#endif /* USE_SHA_NI */
+
+int supported_scalar() {
+    return 1;
+}
+
+#undef S
+#define S(n, x) ((x) << (n) | (x) >> (32 - n))
+
+
+struct mint_kernel {
+    const char* name;
+    int lanes;
+    int (*supported)();
+    void (*final)(const struct mint_block* m, const uint32_t* words,
+                  struct mint_lanes* x);
+    int (*test)(const struct mint_block* m, const uint32_t* words, int bits);
+    int (*test_wide)(const struct mint_block* m, const uint32_t* words,
+                     int bits);
+};
+
+#define KERNEL_ENTRY(name, lanes) \
+    { #name, lanes, supported_##name, mint_final_##name, \
+      mint_test_##name, mint_test_wide_##name }
+
+/* in order of preference when timing doesn't tell them apart */
+const struct mint_kernel mint_kernels[] = {
+#ifdef USE_SHA_NI
+    KERNEL_ENTRY(shani, 4),
+#endif
+#ifdef USE_SIMD
+    KERNEL_ENTRY(avx512, 16),
+    KERNEL_ENTRY(avx2, 8),
+    KERNEL_ENTRY(sse2, 4),
+#endif
+    KERNEL_ENTRY(scalar, 1)
+};
+
+#define KERNEL_COUNT (int)(sizeof mint_kernels / sizeof *mint_kernels)
+
+const struct mint_kernel* mint_kernel = &mint_kernels[KERNEL_COUNT - 1];
+int mint_lanes = 1;
+uint64_t mint_rate = 0;
+
+
+#define INNER (65*65*65) /* values of word 13 */
+
+/* Returns a width of the counter that gives at least 2^16 times the expected
+   number of tries for the given bits. */
+int mint_counter_len(int bits) {
+    int len = (bits + 16 + 5) / 6;
+
+    if (len < MINT_COUNTER_MIN)
+        len = MINT_COUNTER_MIN;
+    if (len > MINT_COUNTER_MAX)
+        len = MINT_COUNTER_MAX;
+    return len;
+}
+
+uint64_t mint_counter_max(int len) {
+    uint64_t max = 1;
+
+    for (; len > 0; len--)
+        max *= 65;
+    return max;
+}
+
+/* Returns the number of characters to add to a prefix of length len so that
+   a counter of width counter_len ends just before the padding. */
+size_t mint_pad(size_t len, int counter_len) {
+    return (55 - counter_len + 64 - len % 64) % 64;
+}
+
+/* s must have len characters */
+void mint_counter(uint64_t counter, int len, char* s) {
+    for (; len > 0; len--) {
+        s[len-1] = alphabet[counter % 65];
+        counter /= 65;
+    }
+}
+
+/* Hashes all the complete blocks of prefix and lays out the last block.
+   The prefix must already be padded, i.e. mint_pad(len, counter_len) == 0. */
+void mint_begin(struct mint_block* m, const char* prefix, size_t len,
+                int counter_len) {
+    struct sha1_info info;
+    uint32_t size = len + counter_len;
+
+    sha1_begin(&info);
+    sha1_string(&info, prefix, len);
+
+    m->len = counter_len;
+    memcpy(m->digest, info.digest, sizeof m->digest);
+    memcpy(m->data, info.data, sizeof m->data);
+    m->data[13] |= 0x80;
+    m->data[14] = size >> (32 - 3);
+    m->data[15] = size << 3;
+}
+
+/* Writes the characters of the counter before the last three, given by
+   outer = counter / 65^3, into the last block and recomputes the rounds and
+   schedule words that don't depend on word 13. */
+void mint_prepare(struct mint_block* m, uint64_t outer) {
+    uint32_t a, b, c, d, e, f, *word;
+    int i, pos, shift;
+
+    for (pos = 55 - 3 - 1; pos >= 55 - m->len; pos--) {
+        word = &m->data[pos / 4];
+        shift = (3 - pos % 4) * 8;
+        *word = *word & ~((uint32_t)0xff << shift) |
+                (uint32_t)(unsigned char)alphabet[outer % 65] << shift;
+        outer /= 65;
+    }
+
+    for (i = 0; i < 16; i++)
+        m->w[i] = m->data[i];
+    for (i = 16; i < 80; i++) {
+        f = m->w[i-3] ^ m->w[i-8] ^ m->w[i-14] ^ m->w[i-16];
+        m->w[i] = S(1, f);
+    }
+
+    a = m->digest[0];
+    b = m->digest[1];
+    c = m->digest[2];
+    d = m->digest[3];
+    e = m->digest[4];
+    for (i = 0; i < 13; i++) {
+        if (i == 12) {
+            m->state12[0] = a;
+            m->state12[1] = b;
+            m->state12[2] = c;
+            m->state12[3] = d;
+            m->state12[4] = e;
+        }
+        f = S(5, a) + (b & (c ^ d) ^ d) + e + m->data[i] + 0x5a827999;
+        e = d;
+        d = c;
+        c = S(30, b);
+        b = a;
+        a = f;
+    }
+    m->state[0] = a;
+    m->state[1] = b;
+    m->state[2] = c;
+    m->state[3] = d;
+    m->state[4] = e;
+}
+
+/* Fills words with n consecutive values of word 13 starting from the given
+   index, counting like an odometer over the last three characters. */
+void mint_words(int inner, int n, uint32_t* words) {
+    int d0 = inner % 65, d1 = inner / 65 % 65, d2 = inner / (65*65), l;
+
+    for (l = 0; l < n; l++) {
+        words[l] = (uint32_t)(unsigned char)alphabet[d2] << 24 |
+                   (uint32_t)(unsigned char)alphabet[d1] << 16 |
+                   (uint32_t)(unsigned char)alphabet[d0] << 8 | 0x80;
+        if (++d0 == 65) {
+            d0 = 0;
+            if (++d1 == 65) {
+                d1 = 0;
+                d2++;
+            }
+        }
+    }
+}
+
+/* Checks whether the digest starts with the given number of zero bits. */
+int mint_zero_bits(const uint32_t* digest, int bits) {
+    int i;
+
+    for (i = 0; i < bits / 32; i++)
+        if (digest[i])
+            return 0;
+    return bits % 32 == 0 || !(digest[i] >> 32 - bits % 32);
+}
+
+/* Hashes the last block with the given word 13 using the scalar library. */
+void mint_digest(const struct mint_block* m, uint32_t word, uint32_t* digest) {
+    struct sha1_info info;
+
+    memcpy(info.digest, m->digest, sizeof info.digest);
+    memcpy(info.data, m->data, sizeof info.data);
+    info.data[13] = word;
+    sha1_update(&info);
+    memcpy(digest, info.digest, sizeof info.digest);
+}
+
+int mint_search_kernel(const struct mint_kernel* kernel, struct mint_block* m,
+                       uint64_t* counter, uint64_t count, int bits) {
+    uint32_t words[MINT_LANES_MAX], digest[5];
+    uint64_t c = *counter, end, max = mint_counter_max(m->len);
+    int inner, l, n, mask;
+    int (*test)(const struct mint_block* m, const uint32_t* words, int bits) =
+        bits <= 32 ? kernel->test : kernel->test_wide;
+
+    end = c < max ? c + (count < max - c ? count : max - c) : c;
+    inner = c % INNER;
+    if (c < end)
+        mint_prepare(m, c / INNER);
+
+    while (c < end) {
+        n = kernel->lanes;
+        if ((uint64_t)n > end - c)
+            n = end - c;
+        if (n > INNER - inner)
+            n = INNER - inner;
+
+        /* unused lanes repeat the first candidate */
+        mint_words(inner, n, words);
+        for (l = n; l < kernel->lanes; l++)
+            words[l] = words[0];
+
+        /* the kernel only checks the first 64 bits */
+        if ((mask = test(m, words, bits) & ((1 << n) - 1)) != 0)
+            for (l = 0; l < n; l++)
+                if (mask & 1 << l) {
+                    mint_digest(m, words[l], digest);
+                    if (mint_zero_bits(digest, bits)) {
+                        *counter = c + l;
+                        return 1;
+                    }
+                }
+
+        c += n;
+        if ((inner += n) == INNER && c < end) {
+            inner = 0;
+            mint_prepare(m, c / INNER);
+        }
+    }
+
+    *counter = c;
+    return 0;
+}
+
+/* Tries up to count values of the counter starting from *counter, stopping at
+   mint_counter_max(). Returns 1 and sets *counter to the first value that
+   gives the required bits, or returns 0 and sets *counter to the value after
+   the last one tried. */
+int mint_search(struct mint_block* m, uint64_t* counter, uint64_t count,
+                int bits) {
+    return mint_search_kernel(mint_kernel, m, counter, count, bits);
+}
+
+/* Returns the number of leading zero bits of the hash given by the counter,
+   which may be more than were searched for. */
+int mint_value(struct mint_block* m, uint64_t counter) {
+    uint32_t word, digest[5];
+    int i;
+
+    mint_prepare(m, counter / INNER);
+    mint_words(counter % INNER, 1, &word);
+    mint_digest(m, word, digest);
+
+    for (i = 0; i < 5; i++)
+        if (digest[i])
+            return i * 32 + __builtin_clz(digest[i]);
+    return 160;
+}
+
+#define TIME_COUNT (1 << 16) /* candidates tried when timing a kernel */
+
+/* Returns the time in nanoseconds the kernel takes to try TIME_COUNT
+   candidates. */
+uint64_t mint_time(const struct mint_kernel* kernel) {
+    char token[64];
+    struct mint_block m;
+    struct timespec start, end;
+    uint64_t counter = 0;
+
+    memset(token, 'a', sizeof token);
+    mint_begin(&m, token, mint_pad(0, MINT_COUNTER_MIN), MINT_COUNTER_MIN);
+
+    /* continue past any stamps found */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (counter < TIME_COUNT)
+        if (mint_search_kernel(kernel, &m, &counter, TIME_COUNT - counter, 32))
+            counter++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+           end.tv_nsec - start.tv_nsec;
+}
+
+/* Selects the fastest kernel supported by the CPU and returns its name. */
+const char* mint_setup() {
+    uint64_t t, best = 0;
+    int i;
+
+#ifdef USE_SIMD
+    __builtin_cpu_init();
+#endif
+
+    for (i = 0; i < KERNEL_COUNT; i++)
+        if (mint_kernels[i].supported()) {
+            t = mint_time(&mint_kernels[i]);
+            if (best == 0 || t < best) {
+                best = t;
+                mint_kernel = &mint_kernels[i];
+                mint_lanes = mint_kernel->lanes;
+            }
+        }
+    mint_rate = (uint64_t)TIME_COUNT * 1000000000 / (best ? best : 1);
+
+    return mint_kernel->name;
+}
+
+
+/* Compares every kernel supported by the CPU against the scalar library for
+   tokens of different lengths and counter widths, including batches that cross
+   a change in the outer characters of the counter and the end of the counter
+   range. */
+int mint_check() {
+    const char check_data[] =
+        "cqlbzjiheywnpfktxrgmvuodasXFQVNAOTGDMSWIBPJCHRLUKZEY4268710935+=/";
+    const int check_len[] = { MINT_COUNTER_MIN, 7, MINT_COUNTER_MAX };
+    const int check_bits[] = { 1, 4, 8, 32, 33 };
+    char token[2*64 + 64];
+    struct sha1_info info;
+    struct mint_block m;
+    struct mint_lanes x;
+    uint32_t words[MINT_LANES_MAX];
+    uint64_t start[3], c, found;
+    size_t len;
+    int i, j, k, l, b, s, status;
+
+    for (i = 0; i < (int)sizeof token; i++)
+        token[i] = check_data[i % (sizeof check_data - 1)];
+
+    for (k = 0; k < KERNEL_COUNT; k++) {
+        if (!mint_kernels[k].supported())
+            continue;
+
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++) {
+                len = i * 64 + mint_pad(0, check_len[j]);
+                start[0] = 0;
+                start[1] = INNER - 5;
+                start[2] = mint_counter_max(check_len[j]) - 5;
+
+                for (s = 0; s < 3; s++) {
+                    /* full digests of one batch */
+                    mint_begin(&m, token, len, check_len[j]);
+                    mint_prepare(&m, start[s] / INNER);
+                    mint_words(start[s] % INNER, mint_kernels[k].lanes, words);
+                    mint_kernels[k].final(&m, words, &x);
+
+                    for (l = 0; l < mint_kernels[k].lanes; l++) {
+                        if (start[s] % INNER + l >= INNER)
+                            break;
+                        mint_counter(start[s] + l, check_len[j], token + len);
+                        sha1_begin(&info);
+                        sha1_string(&info, token, len + check_len[j]);
+                        sha1_done(&info);
+                        for (b = 0; b < 5; b++)
+                            if (info.digest[b] != x.digest[b][l])
+                                return -1;
+                    }
+
+                    /* search */
+                    for (b = 0; b < 5; b++) {
+                        found = start[s];
+                        status = mint_search_kernel(&mint_kernels[k], &m,
+                                                    &found, 100, check_bits[b]);
+
+                        for (c = start[s]; c < start[s] + 100 &&
+                                c < mint_counter_max(check_len[j]); c++) {
+                            mint_counter(c, check_len[j], token + len);
+                            sha1_begin(&info);
+                            sha1_string(&info, token, len + check_len[j]);
+                            sha1_done(&info);
+                            if (mint_zero_bits(info.digest, check_bits[b]))
+                                break;
+                        }
+                        if (status != (c < start[s] + 100 &&
+                                       c < mint_counter_max(check_len[j])) ||
+                                found != c)
+                            return -1;
+                    }
+                }
+            }
+    }
+
+    return 0;
+}
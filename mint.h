@@ -0,0 +1,77 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MINT_H
+#define MINT_H
+
+#include "sha1.h"
+
+#define MINT_LANES_MAX 16
+
+#define MINT_COUNTER_MIN 4
+#define MINT_COUNTER_MAX 10
+/* 65^10 = 10^18 hashes per stamp, enough for 52 bits (see mint_counter_len) */
+
+/* Tokens are laid out so that the counter ends just before the padding in the
+   last block, with the last three characters of the counter in word 13. The
+   candidates in a batch only differ in word 13, and the rounds before it and
+   the schedule words that don't depend on it are computed once for every 65^3
+   values of the counter. */
+struct mint_block {
+    int len;               /* width of the counter */
+    uint32_t digest[5];    /* chaining value of the blocks before the last */
+    uint32_t data[16];     /* last block, with the counter and padding */
+    uint32_t state[5];     /* registers after the rounds before word 13 */
+    uint32_t state12[5];   /* same before word 12, for the SHA extensions */
+    uint32_t w[80];        /* message schedule */
+};
+
+struct mint_lanes { /* transposed, so that a row holds one word of each lane */
+    uint32_t digest[5][MINT_LANES_MAX];
+};
+
+extern int mint_lanes;     /* lanes of the selected kernel */
+extern uint64_t mint_rate; /* hashes per second of the selected kernel */
+
+const char* mint_setup();
+int mint_check();
+
+int mint_counter_len(int bits);
+uint64_t mint_counter_max(int len);
+size_t mint_pad(size_t len, int counter_len);
+void mint_counter(uint64_t counter, int len, char* s);
+
+void mint_begin(struct mint_block* m, const char* prefix, size_t len,
+                int counter_len);
+int mint_search(struct mint_block* m, uint64_t* counter, uint64_t count,
+                int bits);
+int mint_value(struct mint_block* m, uint64_t counter);
+
+#endif /* MINT_H */
@@ -0,0 +1,926 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pool.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef USE_LINUX_SCHED
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+/* Minting is done by a fixed set of worker threads shared by all messages.
+   Each worker repeatedly takes a chunk of the counter range of a stamp that
+   hasn't been found yet, preferring the stamp with the fewest workers on it,
+   so that the stamps of a message are minted in parallel and the workers move
+   on to the remaining stamps as soon as each one is found.
+
+   Jobs are taken in order of the expected tries left for the job plus the
+   tries recently spent on the sender's jobs. Short jobs go first, and a sender
+   with a lot of minting doesn't hold up others, since its later jobs wait
+   until the tries spent on it decay. Idle jobs are only taken when there are
+   no others, and aren't counted in the queue or the backlog. Early jobs, for
+   the stamps a message starts before its end, are counted in the backlog but
+   not the queue, so that the queue limit is a number of messages.
+
+   Deadlines are kept by a single watchdog thread, which cancels the jobs of a
+   message when its time is up, so that the workers only look at the cancelled
+   flag between chunks. Progress reports are made by the thread waiting for the
+   jobs, so that a stalled report holds up nothing but its own message.
+
+   The workers may be given a lower scheduling class, so that the threads
+   handling messages, which check stamps and keep the database of spent ones,
+   never wait behind them, and may be pinned to chosen CPUs. Each pinned worker
+   is created on its own CPU, so that its stack and the copies of the blocks it
+   mints are first touched, and kept, on that CPU's NUMA node.
+
+   Optionally, each worker thread hands its chunks to a process of its own,
+   forked from the thread so that it's placed the same way. The process keeps
+   no descriptors but its socket to the worker, and gets the chunk and returns
+   the result through a slot of shared memory. A process that dies is started
+   again and given the chunk again, so a crash while minting doesn't take down
+   the milter, but a chunk that keeps failing gives up its stamp. */
+
+/* shared with the process minting for a worker */
+struct pool_slot {
+    struct mint_block block;
+    uint64_t counter;        /* first of the chunk, then where it stopped */
+    uint64_t count;
+    int bits;
+    int found;
+};
+
+struct pool_process {
+    struct pool_slot* slot;
+    int fd;                  /* socket to the process, or -1 if none */
+    pid_t pid;
+};
+
+/* tries spent on the jobs of one sender */
+struct pool_share {
+    struct pool_share* next;
+    int jobs;                /* jobs submitted and not yet finished */
+    double used;             /* tries, halved every SHARE_HALF_LIFE seconds */
+    time_t decayed;          /* time of the last halving */
+    char key[];
+};
+
+#define POOL_RESTARTS 3 /* tries at searching a chunk in a process */
+#define SHARE_HALF_LIFE 60
+#define RATE_SMOOTHING 64 /* chunks */
+
+int pool_workers = 0;
+int pool_processes = 0; /* mint in a process for each worker */
+int pool_queue_max = 0; /* jobs waiting or being minted, 0 for no limit */
+
+#define POOL_NORMAL 0
+#define POOL_BATCH 1
+#define POOL_IDLE 2
+
+int pool_class = POOL_NORMAL; /* scheduling class of the workers */
+int pool_nice = 0;
+
+#ifdef USE_LINUX_SCHED
+cpu_set_t pool_cpuset; /* for the workers */
+int pool_ncpus = 0;    /* in the set, 0 for any */
+#endif
+
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_work;  /* jobs were submitted */
+pthread_cond_t pool_done;  /* a job finished, or a cancelled job went idle */
+
+struct mint_job *pool_head = NULL, *pool_tail = NULL;
+int pool_jobs = 0;          /* in the list */
+double pool_backlog = 0;    /* expected tries of the stamps left in the list */
+double pool_rate = 1;       /* tries per second of a worker, measured */
+
+struct pool_share* pool_shares = NULL;
+struct pool_share pool_anonymous; /* for jobs without a key */
+
+struct pool_watch* pool_watches = NULL;
+
+uint64_t pool_chunk = 1 << 16; /* counter values per chunk */
+
+#define CHUNK_RATE 500 /* chunks per second per worker */
+
+
+int pool_clock(struct timespec* ts) {
+    return clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+time_t pool_now() {
+    struct timespec ts;
+
+    return pool_clock(&ts) == -1 ? 0 : ts.tv_sec;
+}
+
+void pool_decay(struct pool_share* share, time_t now) {
+    while (now - share->decayed >= SHARE_HALF_LIFE) {
+        share->decayed += SHARE_HALF_LIFE;
+        if ((share->used /= 2) < 1) {
+            share->used = 0;
+            share->decayed = now;
+        }
+    }
+}
+
+/* Finds or adds the share for the key, dropping those no longer in use. */
+struct pool_share* pool_share(const char* key) {
+    struct pool_share **p, *share, *found = NULL;
+    time_t now = pool_now();
+    size_t len;
+
+    for (p = &pool_shares; (share = *p) != NULL;) {
+        pool_decay(share, now);
+        if (key != NULL && !strcmp(share->key, key))
+            found = share;
+        else if (share->jobs == 0 && share->used == 0) {
+            *p = share->next;
+            free(share);
+            continue;
+        }
+        p = &share->next;
+    }
+    if (found != NULL || key == NULL)
+        return found != NULL ? found : &pool_anonymous;
+
+    len = strlen(key);
+    if ((share = malloc(sizeof *share + len + 1)) == NULL)
+        return &pool_anonymous;
+    share->jobs = 0;
+    share->used = 0;
+    share->decayed = now;
+    memcpy(share->key, key, len + 1);
+    share->next = pool_shares;
+    pool_shares = share;
+    return share;
+}
+
+void pool_unlink(struct mint_job* job) {
+    struct mint_job **p, *prev = NULL;
+
+    for (p = &pool_head; *p != NULL; prev = *p, p = &(*p)->next)
+        if (*p == job) {
+            *p = job->next;
+            if (pool_tail == job)
+                pool_tail = prev;
+            job->next = NULL;
+            job->queued = 0;
+            if (!job->idle && !job->early)
+                pool_jobs--;
+            if (!job->idle)
+                pool_backlog -= job->cost;
+            return;
+        }
+}
+
+/* 2^bits */
+double pool_expected(int bits) {
+    double cost = 1;
+
+    for (; bits > 0; bits--)
+        cost *= 2;
+    return cost;
+}
+
+void pool_finish(struct mint_job* job, struct mint_stamp* stamp, int found) {
+    if (stamp->next < stamp->max)
+        job->open--;
+    stamp->found = found;
+    job->left--;
+    job->cost -= stamp->cost;
+    if (job->queued && !job->idle)
+        pool_backlog -= stamp->cost;
+}
+
+/* Finds the stamp to take the next chunk from. */
+struct mint_stamp* pool_pick(struct mint_job** job_out) {
+    struct mint_job *job, *best_job = NULL;
+    struct mint_stamp *stamp, *best = NULL;
+    double priority, best_priority = 0;
+    time_t now = 0;
+    int i;
+
+    for (job = pool_head; job != NULL; job = job->next)
+        if (job->open != 0) {
+            if (now == 0)
+                now = pool_now();
+            pool_decay(job->share, now);
+            priority = job->share->used + job->cost;
+            if (best_job == NULL || job->idle < best_job->idle ||
+                    job->idle == best_job->idle && priority < best_priority) {
+                best_job = job;
+                best_priority = priority;
+            }
+        }
+    if (best_job == NULL)
+        return NULL;
+
+    for (i = 0; i < best_job->count; i++) {
+        stamp = &best_job->stamps[i];
+        if (!stamp->found && stamp->next < stamp->max &&
+                (best == NULL || stamp->busy < best->busy))
+            best = stamp;
+    }
+    *job_out = best_job;
+    return best;
+}
+
+/* Runs in the process, never returning. */
+void pool_child(int fd, struct pool_slot* slot) {
+    struct rlimit limit;
+    sigset_t set;
+    long i, fd_max;
+    char c;
+
+    fd_max = sysconf(_SC_OPEN_MAX);
+    for (i = 3; i < fd_max; i++)
+        if (i != fd)
+            close(i);
+
+    /* nothing to open, write or fork */
+    limit.rlim_cur = limit.rlim_max = fd + 1;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max = 0;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    setrlimit(RLIMIT_NPROC, &limit);
+
+    /* the worker thread had all signals blocked */
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+
+    while (recv(fd, &c, 1, 0) == 1) {
+        slot->found = mint_search(&slot->block, &slot->counter, slot->count,
+                                  slot->bits);
+        if (send(fd, &c, 1, MSG_NOSIGNAL) != 1)
+            break;
+    }
+    _exit(0);
+}
+
+/* Forks the process for the calling worker. Only async-signal-safe calls and
+   minting are made in the child, since other threads may hold locks. */
+int pool_fork(struct pool_process* proc) {
+    int fds[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        return -1;
+    if ((pid = fork()) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        pool_child(fds[1], proc->slot);
+    }
+    close(fds[1]);
+    proc->fd = fds[0];
+    proc->pid = pid;
+    return 0;
+}
+
+/* Searches the chunk like mint_search() in the worker's process, starting
+   the process again if it can't be started or dies, up to POOL_RESTARTS times.
+   Returns -1 with counter unchanged if the chunk couldn't be searched. */
+int pool_search(struct pool_process* proc, struct mint_block* block,
+                uint64_t* counter, uint64_t count, int bits) {
+    int status, tries = 0;
+    char c = 0;
+
+    for (;;) {
+        if (proc->fd == -1 && pool_fork(proc) == -1)
+            syslog(LOG_ERR, "couldn't start minting process: %m");
+        else {
+            memcpy(&proc->slot->block, block, sizeof *block);
+            proc->slot->counter = *counter;
+            proc->slot->count = count;
+            proc->slot->bits = bits;
+            if (send(proc->fd, &c, 1, MSG_NOSIGNAL) == 1 &&
+                    recv(proc->fd, &c, 1, 0) == 1) {
+                *counter = proc->slot->counter;
+                return proc->slot->found;
+            }
+
+            close(proc->fd);
+            proc->fd = -1;
+            while (waitpid(proc->pid, &status, 0) == -1 && errno == EINTR)
+                ;
+            if (WIFSIGNALED(status))
+                syslog(LOG_ERR, "minting process %ld killed by signal %d",
+                       (long)proc->pid, WTERMSIG(status));
+            else
+                syslog(LOG_ERR, "minting process %ld exited", (long)proc->pid);
+        }
+
+        if (++tries == POOL_RESTARTS) {
+            syslog(LOG_ERR, "minting failed %d times, giving up stamp",
+                   tries);
+            return -1;
+        }
+        sleep(1); /* in case it keeps failing */
+    }
+}
+
+/* Takes a chunk of up to count counter values, or of the usual size if
+   count is zero, waiting for one. The chunk is searched outside the lock and
+   then handed back with pool_give(). */
+void pool_take(struct pool_chunk* chunk, uint64_t count) {
+    struct mint_job* job;
+    struct mint_stamp* stamp;
+
+    pthread_mutex_lock(&pool_mutex);
+    while ((stamp = pool_pick(&job)) == NULL)
+        pthread_cond_wait(&pool_work, &pool_mutex);
+
+    if (count == 0)
+        count = pool_chunk;
+    chunk->job = job;
+    chunk->stamp = stamp;
+    chunk->start = stamp->next;
+    chunk->count = stamp->max - chunk->start;
+    if (chunk->count > count)
+        chunk->count = count;
+    if ((stamp->next += chunk->count) == stamp->max)
+        job->open--;
+    stamp->busy++;
+    job->busy++;
+    chunk->bits = stamp->bits;
+    memcpy(&chunk->block, &stamp->block, sizeof chunk->block);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Hands back the chunk, searched up to counter, which is the stamp if found
+   is 1. If found is -1, the chunk couldn't be searched and the stamp is given
+   up. The chunk took the given time on one worker, or NULL if it wasn't
+   measured or wasn't searched by a worker of the pool. */
+void pool_give(struct pool_chunk* chunk, uint64_t counter, int found,
+               const struct timespec* ts) {
+    struct mint_job* job = chunk->job;
+    struct mint_stamp* stamp = chunk->stamp;
+    uint64_t tries = counter - chunk->start + (found == 1);
+    int value = found == 1 ? mint_value(&chunk->block, counter) : 0;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (ts != NULL && (ts->tv_sec != 0 || ts->tv_nsec != 0))
+        pool_rate += (tries * 1e9 / (ts->tv_sec * 1e9 + ts->tv_nsec) -
+                      pool_rate) / RATE_SMOOTHING;
+    stamp->busy--;
+    job->busy--;
+    job->tries += tries;
+    job->share->used += tries;
+    if (job->watch != NULL)
+        job->watch->tries += tries;
+
+    if (!stamp->found)
+        if (found == 1) {
+            stamp->counter = counter;
+            stamp->value = value;
+            pool_finish(job, stamp, 1);
+        } else if (found == -1 ||
+                   (stamp->next == stamp->max && stamp->busy == 0))
+            pool_finish(job, stamp, -1);
+
+    if (job->left == 0)
+        pool_unlink(job);
+    if ((job->left == 0 || job->cancelled) && job->busy == 0)
+        pthread_cond_broadcast(&pool_done);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Tells if searching the rest of the chunk would be wasted, because the
+   stamp has been found or the job cancelled. */
+int pool_stale(struct pool_chunk* chunk) {
+    int stale;
+
+    pthread_mutex_lock(&pool_mutex);
+    stale = chunk->stamp->found != 0 || chunk->job->cancelled;
+    pthread_mutex_unlock(&pool_mutex);
+    return stale;
+}
+
+void* pool_worker(void* arg) {
+    struct pool_process* proc = arg;
+    struct pool_chunk chunk;
+    struct timespec ts_start, ts;
+    uint64_t counter;
+    int found, timed;
+#ifdef USE_LINUX_SCHED
+    struct sched_param param;
+#endif
+
+#ifdef USE_LINUX_SCHED
+    /* the class is set by the thread itself since thread attributes only
+       take the POSIX classes, and the nice value of a thread is set through
+       its thread ID on Linux */
+    memset(&param, 0, sizeof param);
+    if (pool_class != POOL_NORMAL &&
+            (errno = pthread_setschedparam(pthread_self(),
+                                           pool_class == POOL_IDLE ?
+                                               SCHED_IDLE : SCHED_BATCH,
+                                           &param)) != 0)
+        syslog(LOG_WARNING, "couldn't set scheduling class of minting "
+               "worker: %m");
+    if (pool_nice != 0 &&
+            setpriority(PRIO_PROCESS, syscall(SYS_gettid), pool_nice) == -1)
+        syslog(LOG_WARNING, "couldn't set nice value of minting worker: %m");
+#endif
+
+    if (proc != NULL && pool_fork(proc) == -1)
+        syslog(LOG_ERR, "couldn't start minting process: %m");
+
+    for (;;) {
+        pool_take(&chunk, 0);
+
+        counter = chunk.start;
+        timed = pool_clock(&ts_start) != -1;
+        found = proc != NULL ?
+                    pool_search(proc, &chunk.block, &counter, chunk.count,
+                                chunk.bits) :
+                    mint_search(&chunk.block, &counter, chunk.count,
+                                chunk.bits);
+        timed = timed && pool_clock(&ts) != -1 && ts_delta(&ts, &ts_start) > 0;
+
+        pool_give(&chunk, counter, found, timed ? &ts : NULL);
+    }
+
+    return NULL;
+}
+
+/* Cancels the queued jobs attached to the watch. */
+void pool_expire(struct pool_watch* watch) {
+    struct mint_job *job, *next;
+
+    for (job = pool_head; job != NULL; job = next) {
+        next = job->next;
+        if (job->watch == watch) {
+            job->cancelled = 1;
+            pool_unlink(job);
+        }
+    }
+    pthread_cond_broadcast(&pool_done);
+}
+
+int pool_reached(const struct timespec* now, const struct timespec* deadline) {
+    return (deadline->tv_sec != 0 || deadline->tv_nsec != 0) &&
+           (now->tv_sec > deadline->tv_sec ||
+            now->tv_sec == deadline->tv_sec &&
+            now->tv_nsec >= deadline->tv_nsec);
+}
+
+void* pool_watchdog(void* arg) {
+    struct pool_watch* watch;
+    struct timespec now;
+
+    for (;;) {
+        sleep(1);
+
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_clock(&now) == -1)
+            now.tv_sec = now.tv_nsec = 0;
+        for (watch = pool_watches; watch != NULL; watch = watch->next)
+            if (!watch->expired && !watch->lost &&
+                    (pool_reached(&now, &watch->deadline) ||
+                     watch->cpu != 0 &&
+                     watch->tries >= watch->cpu * pool_rate)) {
+                watch->expired = 1;
+                pool_expire(watch);
+            }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+
+    return NULL;
+}
+
+/* Sets the scheduling class of the workers from "idle", "batch" or a nice
+   value from 1 to 19. Returns -1 with errno EINVAL if the argument is invalid
+   or ENOSYS if this isn't supported. */
+int pool_set_sched(const char* arg) {
+    char* end;
+    long nice;
+
+#ifdef USE_LINUX_SCHED
+    if (!strcmp(arg, "idle"))
+        pool_class = POOL_IDLE;
+    else if (!strcmp(arg, "batch"))
+        pool_class = POOL_BATCH;
+    else {
+        nice = strtol(arg, &end, 10);
+        if (*arg < '0' || *arg > '9' || *end || nice < 1 || nice > 19) {
+            errno = EINVAL;
+            return -1;
+        }
+        pool_nice = nice;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Sets the CPUs for the workers from a comma-separated list of CPU numbers
+   and ranges, e.g. "0-3,8". Returns -1 with errno EINVAL if the list is
+   invalid or ENOSYS if this isn't supported. */
+int pool_set_cpus(const char* list) {
+    char* end;
+    long first, last;
+
+#ifdef USE_LINUX_SCHED
+    CPU_ZERO(&pool_cpuset);
+    for (;;) {
+        first = strtol(list, &end, 10);
+        if (*list < '0' || *list > '9' || first >= CPU_SETSIZE)
+            break;
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (*list < '0' || *list > '9' || last >= CPU_SETSIZE ||
+                    last < first)
+                break;
+        }
+        for (; first <= last; first++)
+            CPU_SET(first, &pool_cpuset);
+        if (*end == '\0') {
+            pool_ncpus = CPU_COUNT(&pool_cpuset);
+            return 0;
+        }
+        if (*end != ',')
+            break;
+        list = end + 1;
+    }
+    errno = EINVAL;
+    return -1;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Pins the ith worker, through the attributes it's created with, to one of
+   the CPUs given to pool_set_cpus(), if any. Returns an error number. */
+int pool_place(pthread_attr_t* attr, int i) {
+#ifdef USE_LINUX_SCHED
+    cpu_set_t set;
+    int cpu, status;
+
+    if (pool_ncpus != 0) {
+        for (i %= pool_ncpus, cpu = 0;; cpu++)
+            if (CPU_ISSET(cpu, &pool_cpuset) && i-- == 0)
+                break;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if ((status = pthread_attr_setaffinity_np(attr, sizeof set,
+                                                  &set)) != 0)
+            return status;
+    }
+#endif
+    return 0;
+}
+
+/* Starts the given number of workers, or one per online processor, or per
+   CPU given to pool_set_cpus(), if zero. */
+int pool_start(int workers) {
+    pthread_condattr_t attr;
+    pthread_attr_t thread_attr, worker_attr;
+    pthread_t thread;
+    sigset_t set, old;
+    struct pool_process* procs = NULL;
+    struct pool_slot* slots;
+    long n;
+    int i, status;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef USE_LINUX_SCHED
+    if (pool_ncpus != 0)
+        n = pool_ncpus;
+#endif
+    if (n <= 0)
+        n = 1;
+    if (workers <= 0)
+        workers = n;
+
+    if ((status = pthread_condattr_init(&attr)) != 0 ||
+            (status = pthread_condattr_setclock(&attr,
+                                                CLOCK_MONOTONIC)) != 0 ||
+            (status = pthread_cond_init(&pool_work, NULL)) != 0 ||
+            (status = pthread_cond_init(&pool_done, &attr)) != 0) {
+        errno = status;
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+
+    /* size chunks so that a worker comes back for more every few
+       milliseconds, to move between stamps and notice cancellations */
+    if (mint_rate / CHUNK_RATE > pool_chunk)
+        pool_chunk = mint_rate / CHUNK_RATE;
+
+    if (pool_processes) {
+        if ((procs = malloc(workers * sizeof *procs)) == NULL)
+            return -1;
+        if ((slots = mmap(NULL, workers * sizeof *slots,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON,
+                          -1, 0)) == MAP_FAILED) {
+            free(procs);
+            return -1;
+        }
+        for (i = 0; i < workers; i++) {
+            procs[i].slot = &slots[i];
+            procs[i].fd = -1;
+        }
+    }
+
+    if ((status = pthread_attr_init(&thread_attr)) != 0 ||
+            (status = pthread_attr_setdetachstate(
+                &thread_attr, PTHREAD_CREATE_DETACHED)) != 0) {
+        errno = status;
+        return -1;
+    }
+
+    /* signals are left to the libmilter signal thread or remote_wait() */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (i = 0; i < workers; i++) {
+        if ((status = pthread_attr_init(&worker_attr)) != 0)
+            break;
+        if ((status = pthread_attr_setdetachstate(
+                 &worker_attr, PTHREAD_CREATE_DETACHED)) == 0 &&
+                (status = pool_place(&worker_attr, i)) == 0)
+            status = pthread_create(&thread, &worker_attr, pool_worker,
+                                    procs != NULL ? &procs[i] : NULL);
+        pthread_attr_destroy(&worker_attr);
+        if (status != 0)
+            break;
+    }
+    if (i != 0 && (status = pthread_create(&thread, &thread_attr,
+                                           pool_watchdog, NULL)) != 0)
+        i = 0; /* the workers wait for jobs forever */
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&thread_attr);
+
+    pool_workers = i;
+    if (i == 0) {
+        errno = status;
+        return -1;
+    }
+    /* until measured, assume the speed at startup on each processor */
+    pool_rate = (double)mint_rate * (i < n ? i : n) / i;
+    if (pool_rate < 1)
+        pool_rate = 1;
+    return 0;
+}
+
+void pool_stamp(struct mint_stamp* stamp, int bits) {
+    stamp->bits = bits;
+    stamp->found = 0;
+    stamp->counter = 0;
+    stamp->value = 0;
+    stamp->next = 0;
+    stamp->max = mint_counter_max(stamp->block.len);
+    stamp->busy = 0;
+    stamp->cost = pool_expected(bits);
+}
+
+/* Queues the job, unless the queue is full or, if budget isn't zero, the
+   workers can't be expected to mint the stamps already queued and those of
+   the job within budget seconds. Idle and early jobs are queued however full
+   the queue is. Returns -1 if the job wasn't queued. */
+int pool_submit(struct mint_job* job, long budget) {
+    int i;
+
+    job->left = job->count;
+    job->busy = 0;
+    job->cancelled = 0;
+    job->tries = 0;
+    job->cost = 0;
+    job->queued = 0;
+    job->share = NULL;
+    job->next = NULL;
+    job->open = 0;
+    for (i = 0; i < job->count; i++) {
+        job->cost += job->stamps[i].cost;
+        if (job->stamps[i].max != 0)
+            job->open++;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    if (job->left != 0 && !job->idle &&
+            (!job->early && pool_queue_max != 0 &&
+             pool_jobs >= pool_queue_max ||
+             budget != 0 &&
+             (pool_backlog + job->cost) / (pool_rate * pool_workers) >
+                 budget)) {
+        pthread_mutex_unlock(&pool_mutex);
+        return -1;
+    }
+
+    job->share = pool_share(job->key);
+    job->share->jobs++;
+    if (job->left != 0) {
+        if (pool_tail != NULL)
+            pool_tail = pool_tail->next = job;
+        else
+            pool_head = pool_tail = job;
+        job->queued = 1;
+        if (!job->idle && !job->early)
+            pool_jobs++;
+        if (!job->idle)
+            pool_backlog += job->cost;
+        pthread_cond_broadcast(&pool_work);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
+
+/* Waits for all stamps of the job to be found or exhausted and for the
+   workers to leave it, up to the given time of pool_clock() or, if until is
+   NULL, for as long as it takes. Returns 1 if they have, after which the job
+   can be freed, or 0 if the time ran out or the job was cancelled. */
+int pool_wait(struct mint_job* job, const struct timespec* until) {
+    int done;
+
+    pthread_mutex_lock(&pool_mutex);
+    while (job->left != 0 && !job->cancelled || job->busy != 0)
+        if (until == NULL)
+            pthread_cond_wait(&pool_done, &pool_mutex);
+        else if (pthread_cond_timedwait(&pool_done, &pool_mutex,
+                                        until) == ETIMEDOUT)
+            break;
+    if ((done = job->left == 0 && job->busy == 0) && job->share != NULL) {
+        job->share->jobs--;
+        job->share = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return done;
+}
+
+/* Waits for the job like pool_wait() without a time limit, making the
+   progress reports of the watch it's attached to in the meantime. */
+int pool_follow(struct mint_job* job, struct pool_watch* watch) {
+    struct timespec next, now;
+    int done, status;
+
+    if (watch->progress == NULL || pool_clock(&next) == -1)
+        return pool_wait(job, NULL);
+    next.tv_sec++;
+
+    pthread_mutex_lock(&pool_mutex);
+    while (job->left != 0 && !job->cancelled || job->busy != 0) {
+        if (watch->expired || watch->lost) {
+            pthread_cond_wait(&pool_done, &pool_mutex);
+            continue;
+        }
+        if (pthread_cond_timedwait(&pool_done, &pool_mutex,
+                                   &next) != ETIMEDOUT)
+            continue;
+
+        /* the report is made without the lock */
+        pthread_mutex_unlock(&pool_mutex);
+        status = watch->progress(watch->arg);
+        if (pool_clock(&now) == -1)
+            now = next;
+        pthread_mutex_lock(&pool_mutex);
+        if (status == -1 && !watch->expired && !watch->lost) {
+            watch->lost = 1;
+            pool_expire(watch);
+        }
+        next = now;
+        next.tv_sec++;
+    }
+    if ((done = job->left == 0 && job->busy == 0) && job->share != NULL) {
+        job->share->jobs--;
+        job->share = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return done;
+}
+
+/* Stops work on the job and waits for the chunks being searched, after which
+   the job can be freed. Does nothing if the job wasn't submitted or has been
+   waited for. */
+void pool_cancel(struct mint_job* job) {
+    pthread_mutex_lock(&pool_mutex);
+    if (job->share != NULL) {
+        job->cancelled = 1;
+        pool_unlink(job);
+        while (job->busy != 0)
+            pthread_cond_wait(&pool_done, &pool_mutex);
+        job->share->jobs--;
+        job->share = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Has the watchdog keep the watch, which must have its fields other than
+   expired, lost, tries and next set. */
+void pool_watch(struct pool_watch* watch) {
+    watch->expired = 0;
+    watch->lost = 0;
+    watch->tries = 0;
+    pthread_mutex_lock(&pool_mutex);
+    watch->next = pool_watches;
+    pool_watches = watch;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Puts the job, if it's still being minted, under the watch. */
+void pool_attach(struct mint_job* job, struct pool_watch* watch) {
+    pthread_mutex_lock(&pool_mutex);
+    if (watch->expired || watch->lost) {
+        if (job->queued) {
+            job->cancelled = 1;
+            pool_unlink(job);
+            pthread_cond_broadcast(&pool_done);
+        }
+    } else if (job->queued)
+        job->watch = watch;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Removes the watch. The jobs under it must have been waited for or
+   cancelled. */
+void pool_unwatch(struct pool_watch* watch) {
+    struct pool_watch** p;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (p = &pool_watches; *p != NULL; p = &(*p)->next)
+        if (*p == watch) {
+            *p = watch->next;
+            break;
+        }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_stats(struct pool_stats* stats) {
+    pthread_mutex_lock(&pool_mutex);
+    stats->jobs = pool_jobs;
+    stats->rate = pool_rate * pool_workers;
+    stats->backlog = stats->rate > 0 ? pool_backlog / stats->rate : 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Returns the highest bits from min_bits to max_bits for which count stamps
+   can be expected to be minted within the given seconds, or min_bits if
+   none. The time to find a stamp varies, so the stamps are allowed around
+   the 95th percentile of their total tries rather than their mean. */
+int pool_fit(int max_bits, int min_bits, int count, long seconds) {
+    double tries, capacity;
+    int bits, root;
+
+    if (count < 1)
+        count = 1;
+    for (root = 1; (root + 1) * (root + 1) <= count; root++)
+        ;
+
+    pthread_mutex_lock(&pool_mutex);
+    capacity = pool_rate * pool_workers;
+    pthread_mutex_unlock(&pool_mutex);
+
+    for (bits = max_bits; bits > min_bits; bits--) {
+        tries = pool_expected(bits) * (count + 2 * root + 1);
+        if (tries <= capacity * seconds)
+            break;
+    }
+    return bits;
+}
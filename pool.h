@@ -0,0 +1,132 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "mint.h"
+
+#include <stdint.h>
+#include <time.h>
+
+struct pool_share;
+struct pool_watch;
+
+/* A stamp being minted. Its counter range is handed out to the workers in
+   chunks, and the first chunk that finds the bits finishes the stamp. */
+struct mint_stamp {
+    struct mint_block block; /* laid out by mint_begin(), copied by workers */
+    int bits;
+    int found;               /* 1 if found, -1 if exhausted or given up */
+    uint64_t counter;        /* counter giving the bits, if found */
+    int value;               /* zero bits actually given by the counter */
+    uint64_t next;           /* first counter value not handed out yet */
+    uint64_t max;            /* mint_counter_max() */
+    int busy;                /* chunks being searched */
+    double cost;             /* expected number of tries */
+};
+
+/* The stamps of one message, minted together by all workers. */
+struct mint_job {
+    struct mint_stamp* stamps;
+    int count;
+    const char* key;         /* sender for sharing the workers, or NULL */
+    int left;                /* stamps neither found nor exhausted */
+    int open;                /* stamps with chunks left to hand out */
+    int busy;                /* chunks being searched */
+    int cancelled;
+    int idle;                /* only minted while no other job has chunks */
+    int early;               /* started ahead of the job of its message,
+                                which alone is counted in the queue */
+    int queued;              /* in the list the workers take chunks from */
+    uint64_t tries;
+    double cost;             /* expected tries of the stamps left */
+    struct pool_share* share;
+    struct pool_watch* watch; /* or NULL */
+    struct mint_job* next;
+};
+
+/* The deadline of a message, kept by the watchdog thread for the jobs
+   attached to it. At the deadline the jobs are cancelled and expired is set.
+   While pool_follow() waits for the jobs, the progress callback is called
+   about every second by the waiting thread, and returning -1 from it cancels
+   the jobs and sets lost. */
+struct pool_watch {
+    struct timespec deadline; /* of pool_clock(), or zero for none */
+    double cpu;              /* seconds of a worker's time, or zero for none */
+    int (*progress)(void* arg); /* or NULL */
+    void* arg;
+    int expired;
+    int lost;
+    uint64_t tries;          /* spent on the jobs since they were attached */
+    struct pool_watch* next;
+};
+
+/* A range of counter values of a stamp, taken to be searched outside the
+   pool. */
+struct pool_chunk {
+    struct mint_job* job;
+    struct mint_stamp* stamp;
+    struct mint_block block;
+    uint64_t start;
+    uint64_t count;
+    int bits;
+};
+
+struct pool_stats {
+    int jobs;                /* queued */
+    double backlog;          /* seconds to mint the stamps queued */
+    double rate;             /* tries per second of all workers */
+};
+
+extern int pool_workers;
+extern int pool_processes;
+extern int pool_queue_max;
+
+int pool_set_sched(const char* arg);
+int pool_set_cpus(const char* list);
+int pool_start(int workers);
+void pool_stamp(struct mint_stamp* stamp, int bits);
+int pool_submit(struct mint_job* job, long budget);
+int pool_wait(struct mint_job* job, const struct timespec* until);
+int pool_follow(struct mint_job* job, struct pool_watch* watch);
+void pool_cancel(struct mint_job* job);
+void pool_watch(struct pool_watch* watch);
+void pool_attach(struct mint_job* job, struct pool_watch* watch);
+void pool_unwatch(struct pool_watch* watch);
+int pool_clock(struct timespec* ts);
+void pool_take(struct pool_chunk* chunk, uint64_t count);
+void pool_give(struct pool_chunk* chunk, uint64_t counter, int found,
+               const struct timespec* ts);
+int pool_stale(struct pool_chunk* chunk);
+void pool_stats(struct pool_stats* stats);
+int pool_fit(int max_bits, int min_bits, int count, long seconds);
+
+#endif /* POOL_H */
@@ -0,0 +1,315 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "premint.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Recipients are counted as messages are minted for them, and those counted
+   at least PREMINT_FREQUENT times get a stamp minted ahead of time by an idle
+   job, which the workers only take when there's no other minting to do. The
+   stamp is handed to the next message for the recipient on the same date that
+   it's worth enough for, and then another one is minted. A stamp worth less
+   than stamps minted ahead are worth now, e.g. because the workers were
+   measured faster, is minted again. Counts are halved every PREMINT_HALF_LIFE
+   seconds, and recipients whose count falls to zero are forgotten. */
+
+#define PREMINT_FREQUENT 2
+#define PREMINT_HALF_LIFE 3600
+#define PREMINT_BUCKETS 1024
+#define PREMINT_INTERVAL 1 /* seconds between looking for a stamp to mint */
+#define PREMINT_KEY "premint" /* for sharing the workers */
+
+struct premint_rcpt {
+    struct premint_rcpt* next;
+    unsigned count;
+    struct string* stamp;     /* minted ahead, or NULL */
+    char rcpt[];              /* local@domain */
+};
+
+int premint_max = 0; /* recipients counted, 0 to disable */
+
+int (*premint_bits)();
+struct string* (*premint_begin)(const char* rcpt, const char* date, int bits,
+                                struct mint_stamp* stamp);
+
+pthread_mutex_t premint_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct premint_rcpt* premint_table[PREMINT_BUCKETS];
+int premint_count = 0;
+time_t premint_decayed = 0;
+
+
+/* Hashes local@domain, given either as one string with domain NULL, or as
+   the local part and the domain. */
+unsigned premint_hash(const char* s, const char* domain) {
+    unsigned hash = 2166136261u; /* FNV-1a */
+
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    if (domain != NULL) {
+        hash = (hash ^ '@') * 16777619u;
+        for (s = domain; *s; s++)
+            hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+    return hash % PREMINT_BUCKETS;
+}
+
+/* Finds the recipient given as "local\0domain\0". */
+struct premint_rcpt* premint_find(const char* rcpt) {
+    const char* domain = strchr(rcpt, '\0') + 1;
+    size_t len = domain - 1 - rcpt;
+    struct premint_rcpt* r;
+
+    for (r = premint_table[premint_hash(rcpt, domain)]; r != NULL;
+         r = r->next)
+        if (!strncmp(r->rcpt, rcpt, len) && r->rcpt[len] == '@' &&
+                !strcmp(r->rcpt + len + 1, domain))
+            return r;
+    return NULL;
+}
+
+void premint_decay(time_t now) {
+    struct premint_rcpt **p, *r;
+    int i;
+
+    if (premint_decayed == 0)
+        premint_decayed = now;
+    if (now - premint_decayed < PREMINT_HALF_LIFE)
+        return;
+    premint_decayed = now;
+
+    for (i = 0; i < PREMINT_BUCKETS; i++)
+        for (p = &premint_table[i]; (r = *p) != NULL;)
+            if ((r->count /= 2) == 0) {
+                *p = r->next;
+                free(r->stamp);
+                free(r);
+                premint_count--;
+            } else
+                p = &r->next;
+}
+
+/* Counts a message for the recipient given as "local\0domain\0". */
+void premint_learn(const char* rcpt) {
+    const char* domain = strchr(rcpt, '\0') + 1;
+    struct premint_rcpt* r;
+    unsigned hash;
+
+    if (premint_max == 0)
+        return;
+
+    pthread_mutex_lock(&premint_mutex);
+    premint_decay(time(NULL));
+    if ((r = premint_find(rcpt)) != NULL)
+        r->count++;
+    else if (premint_count < premint_max &&
+             (r = malloc(sizeof *r + strlen(rcpt) + 1 + strlen(domain) + 1))
+                 != NULL) {
+        sprintf(r->rcpt, "%s@%s", rcpt, domain);
+        r->count = 1;
+        r->stamp = NULL;
+        hash = premint_hash(rcpt, domain);
+        r->next = premint_table[hash];
+        premint_table[hash] = r;
+        premint_count++;
+    }
+    pthread_mutex_unlock(&premint_mutex);
+}
+
+/* Returns the stamp minted ahead for the recipient given as
+   "local\0domain\0", if it's for the date and has at least the given value,
+   or NULL. The stamp is only handed out once. */
+struct string* premint_take(const char* rcpt, const char* date, int bits) {
+    struct premint_rcpt* r;
+    struct string* token = NULL;
+
+    if (premint_max == 0)
+        return NULL;
+
+    /* a stamp worth too little is left for another message */
+    pthread_mutex_lock(&premint_mutex);
+    if ((r = premint_find(rcpt)) != NULL && r->stamp != NULL &&
+            token_value(r->stamp->string, date, date) >= bits) {
+        token = r->stamp;
+        r->stamp = NULL;
+    }
+    pthread_mutex_unlock(&premint_mutex);
+    return token;
+}
+
+/* Returns the date field of a token. */
+const char* premint_date(const char* token) {
+    return strchr(strchr(token, ':') + 1, ':') + 1;
+}
+
+/* Mints a stamp of the given value for the recipient given as
+   "local\0domain\0". Returns NULL on failure. */
+struct string* premint_mint(const char* rcpt, const char* date, int bits) {
+    struct mint_job job;
+    struct mint_stamp stamp;
+    struct timespec until;
+    struct string* token;
+    char* s;
+    int len;
+
+    if ((token = premint_begin(rcpt, date, bits, &stamp)) == NULL)
+        return NULL;
+
+    memset(&job, 0, sizeof job);
+    job.stamps = &stamp;
+    job.count = 1;
+    job.key = PREMINT_KEY;
+    job.idle = 1;
+    if (pool_submit(&job, 0) == -1) {
+        free(token);
+        return NULL;
+    }
+    for (;;) {
+        if (pool_clock(&until) == -1) {
+            syslog(LOG_ERR, "clock_gettime() failed: %m");
+            pool_cancel(&job);
+            free(token);
+            return NULL;
+        }
+        until.tv_sec += PREMINT_INTERVAL;
+        if (pool_wait(&job, &until))
+            break;
+    }
+
+    if (stamp.found != 1) {
+        free(token);
+        return NULL;
+    }
+    len = mint_counter_len(stamp.bits);
+    s = strchr(token->string, '\0');
+    mint_counter(stamp.counter, len, s);
+    s[len] = '\0';
+    return token;
+}
+
+void* premint_worker(void* arg) {
+    struct premint_rcpt *r, *best;
+    struct string* token;
+    char date[6+1], *rcpt;
+    time_t now;
+    int i, bits;
+
+    for (;; sleep(PREMINT_INTERVAL)) {
+        if ((now = time(NULL)) == (time_t)-1 ||
+                format_date(now, 0, date, sizeof date - 1) == -1)
+            continue;
+        bits = premint_bits();
+
+        /* the most frequent recipient without a stamp for today worth the
+           value */
+        pthread_mutex_lock(&premint_mutex);
+        premint_decay(now);
+        best = NULL;
+        for (i = 0; i < PREMINT_BUCKETS; i++)
+            for (r = premint_table[i]; r != NULL; r = r->next) {
+                if (r->stamp != NULL &&
+                        (strncmp(premint_date(r->stamp->string), date, 6) ||
+                         token_value(r->stamp->string, date, date) < bits)) {
+                    free(r->stamp);
+                    r->stamp = NULL;
+                }
+                if (r->stamp == NULL && r->count >= PREMINT_FREQUENT &&
+                        (best == NULL || r->count > best->count))
+                    best = r;
+            }
+        rcpt = best != NULL ? malloc(strlen(best->rcpt) + 2) : NULL;
+        if (rcpt != NULL) {
+            strcpy(rcpt, best->rcpt);
+            *strrchr(rcpt, '@') = '\0';
+            rcpt[strlen(best->rcpt) + 1] = '\0';
+        }
+        pthread_mutex_unlock(&premint_mutex);
+        if (rcpt == NULL)
+            continue;
+
+        /* the recipient may be forgotten while minting */
+        if ((token = premint_mint(rcpt, date, bits)) != NULL) {
+            pthread_mutex_lock(&premint_mutex);
+            if ((r = premint_find(rcpt)) != NULL && r->stamp == NULL) {
+                r->stamp = token;
+                token = NULL;
+            }
+            pthread_mutex_unlock(&premint_mutex);
+            free(token);
+        }
+        free(rcpt);
+    }
+
+    return NULL;
+}
+
+/* Starts minting stamps ahead of time, of the value returned by bits when
+   each is started, with begin making the token and laying out the stamp as
+   for a message. */
+int premint_start(int (*bits)(),
+                  struct string* (*begin)(const char* rcpt, const char* date,
+                                          int bits,
+                                          struct mint_stamp* stamp)) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t set, old;
+    int status;
+
+    premint_bits = bits;
+    premint_begin = begin;
+
+    if ((status = pthread_attr_init(&attr)) != 0 ||
+            (status = pthread_attr_setdetachstate(
+                &attr, PTHREAD_CREATE_DETACHED)) != 0) {
+        errno = status;
+        return -1;
+    }
+
+    /* signals are left to the libmilter signal thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    status = pthread_create(&thread, &attr, premint_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
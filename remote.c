@@ -0,0 +1,695 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "remote.h"
+#include "entropy.h"
+#include "pool.h"
+#include "sha1.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* Minting can be offloaded to other hosts running the milter as a remote
+   worker. For each peer, a thread takes chunks from the pool like a worker,
+   sized to about REMOTE_SECONDS of the peer's measured speed, and has the
+   peer search them, so that faster peers take more of the work. The local
+   workers keep minting the same stamps, and a chunk that fails or times out
+   is left unsearched, so minting carries on locally if peers go away.
+
+   A peer only gets the chaining value and the last block of a stamp, not the
+   token, and a stamp it reports is checked before it's used. Connections are
+   authenticated by a shared key: the peer sends a random challenge and the
+   client answers with its HMAC-SHA1.
+
+   Messages are sequences of 32-bit words in network order. A request is the
+   counter width, the chaining value, the last block, the first counter value
+   and the number of values as 64-bit pairs, and the bits. The reply is a
+   status and a counter value: the stamp if found, otherwise where the search
+   stopped. While a request is minted, the client may send REMOTE_CANCEL. */
+
+#define REMOTE_MAGIC "hashcash-milter remote 1"
+#define REMOTE_KEY_MIN 16
+#define REMOTE_KEY_MAX 1024
+#define REMOTE_NONCE 32      /* letters */
+#define REMOTE_SECONDS 1     /* of a peer's minting per chunk */
+#define REMOTE_TIMEOUT 10    /* seconds to wait for a peer beyond that */
+#define REMOTE_RETRY 10      /* seconds between attempts to connect */
+#define REMOTE_POLL 100      /* milliseconds between checks for cancelling */
+
+#define REMOTE_REQUEST 27    /* words */
+#define REMOTE_REPLY 3
+#define REMOTE_CANCEL 0xffffffff
+
+#define REMOTE_NOT_FOUND 0
+#define REMOTE_FOUND 1
+#define REMOTE_REFUSED 2
+
+struct remote_peer {
+    struct remote_peer* next;
+    char* host;
+    char* port;
+    int fd;                  /* or -1 if not connected */
+    double rate;             /* tries per second, measured */
+    int failed;              /* the failure has been logged */
+};
+
+char remote_key[REMOTE_KEY_MAX];
+size_t remote_key_len = 0;
+
+struct remote_peer* remote_peers = NULL;
+int remote_fd = -1; /* listening as a remote worker */
+
+
+/* Reads the shared key from the first line of the file. */
+int remote_read_key(const char* file) {
+    ssize_t n;
+    int fd;
+
+    do
+        fd = open(file, O_RDONLY);
+    while (fd == -1 && errno == EINTR);
+    if (fd == -1)
+        return -1;
+    do
+        n = read(fd, remote_key, sizeof remote_key);
+    while (n == -1 && errno == EINTR);
+    close(fd);
+    if (n == -1)
+        return -1;
+
+    remote_key_len = n;
+    while (remote_key_len > 0 && (remote_key[remote_key_len-1] == '\n' ||
+                                  remote_key[remote_key_len-1] == '\r'))
+        remote_key_len--;
+    if (remote_key_len < REMOTE_KEY_MIN || n == sizeof remote_key ||
+            memchr(remote_key, '\n', remote_key_len) != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Splits "port@host" into newly allocated strings. */
+int remote_parse(const char* addr, char** port, char** host) {
+    const char* at = strchr(addr, '@');
+
+    if (at == NULL || at == addr || at[1] == '\0')
+        return -1;
+    *port = strdup(addr);
+    *host = strdup(at + 1);
+    if (*port == NULL || *host == NULL) {
+        free(*port);
+        free(*host);
+        return -1;
+    }
+    (*port)[at - addr] = '\0';
+    return 0;
+}
+
+/* Adds peers from a comma-separated list of port@host. */
+int remote_add_peers(const char* list) {
+    struct remote_peer* peer;
+    char *copy, *addr, *s;
+
+    if ((copy = strdup(list)) == NULL)
+        return -1;
+    for (addr = strtok_r(copy, ",", &s); addr != NULL;
+         addr = strtok_r(NULL, ",", &s)) {
+        if ((peer = malloc(sizeof *peer)) == NULL ||
+                remote_parse(addr, &peer->port, &peer->host) == -1) {
+            free(peer);
+            free(copy);
+            return -1;
+        }
+        peer->fd = -1;
+        peer->rate = mint_rate;
+        peer->failed = 0;
+        peer->next = remote_peers;
+        remote_peers = peer;
+    }
+    free(copy);
+    return remote_peers != NULL ? 0 : -1;
+}
+
+/* Computes HMAC-SHA1 of the challenge with the shared key. */
+void remote_hmac(const char* nonce, unsigned char* mac) {
+    struct sha1_info info;
+    unsigned char key[64], pad[64];
+    char inner[20];
+    int i;
+
+    memset(key, 0, sizeof key);
+    if (remote_key_len > sizeof key) {
+        sha1_begin(&info);
+        sha1_string(&info, remote_key, remote_key_len);
+        sha1_done(&info);
+        for (i = 0; i < 20; i++)
+            key[i] = info.digest[i / 4] >> (3 - i % 4) * 8;
+    } else
+        memcpy(key, remote_key, remote_key_len);
+
+    for (i = 0; i < 64; i++)
+        pad[i] = key[i] ^ 0x36;
+    sha1_begin(&info);
+    sha1_string(&info, (char*)pad, sizeof pad);
+    sha1_string(&info, REMOTE_MAGIC, sizeof REMOTE_MAGIC - 1);
+    sha1_string(&info, nonce, REMOTE_NONCE);
+    sha1_done(&info);
+    for (i = 0; i < 20; i++)
+        inner[i] = info.digest[i / 4] >> (3 - i % 4) * 8;
+
+    for (i = 0; i < 64; i++)
+        pad[i] = key[i] ^ 0x5c;
+    sha1_begin(&info);
+    sha1_string(&info, (char*)pad, sizeof pad);
+    sha1_string(&info, inner, sizeof inner);
+    sha1_done(&info);
+    for (i = 0; i < 20; i++)
+        mac[i] = info.digest[i / 4] >> (3 - i % 4) * 8;
+}
+
+int remote_write(int fd, const void* buf, size_t len) {
+    const char* s = buf;
+    ssize_t n;
+
+    while (len != 0)
+        if ((n = send(fd, s, len, MSG_NOSIGNAL)) == -1) {
+            if (errno != EINTR)
+                return -1;
+        } else {
+            s += n;
+            len -= n;
+        }
+    return 0;
+}
+
+/* Reads exactly len bytes. Returns -1 on error, timeout or end of file. */
+int remote_read(int fd, void* buf, size_t len) {
+    char* s = buf;
+    ssize_t n;
+
+    while (len != 0)
+        if ((n = recv(fd, s, len, 0)) == -1) {
+            if (errno != EINTR)
+                return -1;
+        } else if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        } else {
+            s += n;
+            len -= n;
+        }
+    return 0;
+}
+
+/* Sends or receives words, converting them in place. */
+int remote_words(int fd, uint32_t* words, int count, int send) {
+    int i;
+
+    if (send) {
+        for (i = 0; i < count; i++)
+            words[i] = htonl(words[i]);
+        return remote_write(fd, words, count * sizeof *words);
+    }
+    if (remote_read(fd, words, count * sizeof *words) == -1)
+        return -1;
+    for (i = 0; i < count; i++)
+        words[i] = ntohl(words[i]);
+    return 0;
+}
+
+void remote_timeout(int fd, int seconds) {
+    struct timeval tv;
+    int one = 1;
+
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+
+/* client side */
+
+int remote_connect(struct remote_peer* peer) {
+    struct addrinfo hints, *info, *ai;
+    unsigned char mac[20];
+    char nonce[REMOTE_NONCE];
+    uint32_t ok;
+    int fd = -1, status;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = SOCK_STREAM;
+    if ((status = getaddrinfo(peer->host, peer->port, &hints, &info)) != 0) {
+        errno = status == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = info; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                         ai->ai_protocol)) == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if (fd == -1)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    remote_timeout(fd, REMOTE_TIMEOUT);
+    if (remote_read(fd, nonce, sizeof nonce) == -1)
+        goto failed;
+    remote_hmac(nonce, mac);
+    if (remote_write(fd, mac, sizeof mac) == -1)
+        goto failed;
+    if (remote_words(fd, &ok, 1, 0) == -1) {
+        if (errno == ECONNRESET)
+            errno = EACCES; /* the key was refused */
+        goto failed;
+    }
+    peer->fd = fd;
+    return 0;
+
+failed:
+    close(fd);
+    return -1;
+}
+
+/* Has the peer search the chunk. Returns 0 with the result, 1 if the peer
+   refused it, or -1 if the connection failed. */
+int remote_mint(struct remote_peer* peer, struct pool_chunk* chunk,
+                uint64_t* counter, int* found) {
+    uint32_t words[REMOTE_REQUEST], *w = words;
+    struct timespec ts_start, ts;
+    struct pollfd pfd;
+    int i, status, cancelled = 0;
+
+    *w++ = chunk->block.len;
+    for (i = 0; i < 5; i++)
+        *w++ = chunk->block.digest[i];
+    for (i = 0; i < 16; i++)
+        *w++ = chunk->block.data[i];
+    *w++ = chunk->start >> 32;
+    *w++ = chunk->start;
+    *w++ = chunk->count >> 32;
+    *w++ = chunk->count;
+    *w++ = chunk->bits;
+    if (pool_clock(&ts_start) == -1 ||
+            remote_words(peer->fd, words, REMOTE_REQUEST, 1) == -1)
+        return -1;
+
+    /* wait, telling the peer to stop if the stamp is found elsewhere */
+    pfd.fd = peer->fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        if ((status = poll(&pfd, 1, REMOTE_POLL)) == -1 && errno != EINTR)
+            return -1;
+        if (status > 0)
+            break;
+        if (pool_clock(&ts) == -1)
+            return -1;
+        if (ts_delta(&ts, &ts_start) >= 0 &&
+                ts.tv_sec >= REMOTE_SECONDS + REMOTE_TIMEOUT) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (!cancelled && pool_stale(chunk)) {
+            words[0] = REMOTE_CANCEL;
+            if (remote_words(peer->fd, words, 1, 1) == -1)
+                return -1;
+            cancelled = 1;
+        }
+    }
+    if (remote_words(peer->fd, words, REMOTE_REPLY, 0) == -1)
+        return -1;
+
+    *counter = (uint64_t)words[1] << 32 | words[2];
+    *found = words[0] == REMOTE_FOUND;
+    if (words[0] == REMOTE_REFUSED) {
+        *counter = chunk->start;
+        return 1;
+    }
+    if (words[0] != REMOTE_NOT_FOUND && words[0] != REMOTE_FOUND ||
+            *counter < chunk->start ||
+            *counter - chunk->start > chunk->count - *found ||
+            *found && mint_value(&chunk->block, *counter) < chunk->bits) {
+        syslog(LOG_ERR, "remote: %s@%s returned an incorrect result",
+               peer->port, peer->host);
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* aim for chunks of REMOTE_SECONDS */
+    if (!cancelled && pool_clock(&ts) != -1 &&
+            ts_delta(&ts, &ts_start) > 0)
+        peer->rate += ((*counter - chunk->start + *found) * 1e9 /
+                       (ts.tv_sec * 1e9 + ts.tv_nsec) - peer->rate) / 4;
+    return 0;
+}
+
+void* remote_client(void* arg) {
+    struct remote_peer* peer = arg;
+    struct pool_chunk chunk;
+    uint64_t counter, count;
+    int found, status;
+
+    for (;;) {
+        if (peer->fd == -1) {
+            if (remote_connect(peer) == -1) {
+                if (!peer->failed++)
+                    syslog(LOG_NOTICE, "remote: couldn't connect to %s@%s: "
+                           "%m", peer->port, peer->host);
+                sleep(REMOTE_RETRY);
+                continue;
+            }
+            syslog(LOG_INFO, "remote: connected to %s@%s",
+                   peer->port, peer->host);
+            peer->failed = 0;
+        }
+
+        count = peer->rate * REMOTE_SECONDS;
+        pool_take(&chunk, count > 0 ? count : 1);
+        if ((status = remote_mint(peer, &chunk, &counter, &found)) != 0) {
+            /* the chunk is left unsearched */
+            pool_give(&chunk, chunk.start, 0, NULL);
+            if (status == 1) {
+                sleep(1);
+                continue;
+            }
+            syslog(LOG_NOTICE, "remote: minting at %s@%s failed: %m",
+                   peer->port, peer->host);
+            close(peer->fd);
+            peer->fd = -1;
+            peer->rate /= 2;
+            peer->failed = 1;
+            sleep(REMOTE_RETRY);
+            continue;
+        }
+        pool_give(&chunk, counter, found, NULL);
+    }
+
+    return NULL;
+}
+
+int remote_thread(void* (*start)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t set, old;
+    int status;
+
+    if ((status = pthread_attr_init(&attr)) != 0 ||
+            (status = pthread_attr_setdetachstate(
+                &attr, PTHREAD_CREATE_DETACHED)) != 0) {
+        errno = status;
+        return -1;
+    }
+
+    /* signals are left to the libmilter signal thread or remote_wait() */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    status = pthread_create(&thread, &attr, start, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+/* Starts a thread for each peer. */
+int remote_start() {
+    struct remote_peer* peer;
+
+    for (peer = remote_peers; peer != NULL; peer = peer->next)
+        if (remote_thread(remote_client, peer) == -1)
+            return -1;
+    return 0;
+}
+
+
+/* remote worker side */
+
+/* Opens the listening socket given as port@address. */
+int remote_listen(const char* addr) {
+    struct addrinfo hints, *info, *ai;
+    char *port, *host;
+    int fd = -1, status, one = 1;
+
+    if (remote_parse(addr, &port, &host) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    status = getaddrinfo(host, port, &hints, &info);
+    free(port);
+    free(host);
+    if (status != 0) {
+        errno = status == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+        return -1;
+    }
+    for (ai = info; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                         ai->ai_protocol)) == -1)
+            continue;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                       sizeof one) == 0 &&
+                bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                listen(fd, SOMAXCONN) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if (fd == -1)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    remote_fd = fd;
+    return 0;
+}
+
+/* Mints a request with the pool. Returns -1 if the client went away. */
+int remote_request(int fd, const char* key, uint32_t* words) {
+    struct mint_job job;
+    struct mint_stamp stamp;
+    struct timespec until;
+    uint64_t start, count, max;
+    uint32_t cancel, *w = words;
+    int i, status, done = 0;
+    char c;
+
+    memset(&stamp, 0, sizeof stamp);
+    stamp.block.len = *w++;
+    for (i = 0; i < 5; i++)
+        stamp.block.digest[i] = *w++;
+    for (i = 0; i < 16; i++)
+        stamp.block.data[i] = *w++;
+    start = (uint64_t)w[0] << 32 | w[1];
+    count = (uint64_t)w[2] << 32 | w[3];
+    if (stamp.block.len < MINT_COUNTER_MIN ||
+            stamp.block.len > MINT_COUNTER_MAX || w[4] < 1 || w[4] > 160 ||
+            start >= (max = mint_counter_max(stamp.block.len)) ||
+            count == 0) {
+        syslog(LOG_NOTICE, "remote: invalid request from %s", key);
+        return -1;
+    }
+    pool_stamp(&stamp, w[4]);
+    stamp.next = start;
+    stamp.max = count < max - start ? start + count : max;
+
+    memset(&job, 0, sizeof job);
+    job.stamps = &stamp;
+    job.count = 1;
+    job.key = key;
+    words[1] = start >> 32;
+    words[2] = start;
+    if (pool_submit(&job, 0) == -1) {
+        words[0] = REMOTE_REFUSED;
+        return 0;
+    }
+
+    while (!done) {
+        if (pool_clock(&until) == -1) {
+            pool_cancel(&job);
+            return -1;
+        }
+        until.tv_nsec += REMOTE_POLL * 1000000l;
+        if (until.tv_nsec >= 1000000000l) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000l;
+        }
+        if ((done = pool_wait(&job, &until)))
+            break;
+
+        /* the client cancelled or went away */
+        if ((status = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT)) == 0 ||
+                status == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+            pool_cancel(&job);
+            return -1;
+        }
+        if (status == 1) {
+            pool_cancel(&job);
+            if (remote_words(fd, &cancel, 1, 0) == -1 ||
+                    cancel != REMOTE_CANCEL)
+                return -1;
+            break;
+        }
+    }
+
+    if (stamp.found == 1) {
+        words[0] = REMOTE_FOUND;
+        words[1] = stamp.counter >> 32;
+        words[2] = stamp.counter;
+    } else {
+        words[0] = REMOTE_NOT_FOUND;
+        if (done) {
+            words[1] = stamp.max >> 32;
+            words[2] = stamp.max;
+        }
+    }
+    return 0;
+}
+
+void* remote_connection(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof addr;
+    char key[7 + NI_MAXHOST], nonce[REMOTE_NONCE];
+    unsigned char mac[20], expected[20], diff = 0;
+    uint32_t words[REMOTE_REQUEST];
+    int i;
+
+    strcpy(key, "remote:");
+    if (getpeername(fd, (struct sockaddr*)&addr, &addr_len) == -1 ||
+            getnameinfo((struct sockaddr*)&addr, addr_len, key + 7,
+                        NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0)
+        strcpy(key + 7, "unknown");
+
+    /* authenticate the client */
+    remote_timeout(fd, REMOTE_TIMEOUT);
+    if (entropy_letters(nonce, sizeof nonce) == -1) {
+        syslog(LOG_ERR, "remote: couldn't draw random letters: %m");
+        goto closed;
+    }
+    remote_hmac(nonce, expected);
+    if (remote_write(fd, nonce, sizeof nonce) == -1 ||
+            remote_read(fd, mac, sizeof mac) == -1)
+        goto closed;
+    for (i = 0; i < 20; i++)
+        diff |= mac[i] ^ expected[i];
+    if (diff) {
+        syslog(LOG_NOTICE, "remote: %s failed to authenticate", key + 7);
+        goto closed;
+    }
+    words[0] = 1;
+    if (remote_words(fd, words, 1, 1) == -1)
+        goto closed;
+    syslog(LOG_INFO, "remote: %s connected", key + 7);
+
+    /* the client may stay idle for long, and a cancellation may arrive
+       after the reply */
+    remote_timeout(fd, 0);
+    for (;;) {
+        if (remote_words(fd, words, 1, 0) == -1)
+            break;
+        if (words[0] == REMOTE_CANCEL)
+            continue;
+        if (remote_words(fd, words + 1, REMOTE_REQUEST - 1, 0) == -1 ||
+                remote_request(fd, key, words) == -1 ||
+                remote_words(fd, words, REMOTE_REPLY, 1) == -1)
+            break;
+    }
+    syslog(LOG_INFO, "remote: %s disconnected", key + 7);
+
+closed:
+    close(fd);
+    return NULL;
+}
+
+void* remote_accept(void* arg) {
+    int fd;
+
+    for (;;) {
+        if ((fd = accept(remote_fd, NULL, NULL)) == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                syslog(LOG_ERR, "remote: accept() failed: %m");
+                sleep(1);
+            }
+            continue;
+        }
+        if (remote_thread(remote_connection, (void*)(intptr_t)fd) == -1) {
+            syslog(LOG_ERR, "remote: couldn't start connection thread: %m");
+            close(fd);
+        }
+    }
+
+    return NULL;
+}
+
+/* Starts taking requests on the socket from remote_listen(). */
+int remote_serve() {
+    return remote_thread(remote_accept, NULL);
+}
+
+/* Waits for a signal to stop the remote worker. */
+int remote_wait() {
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    return sigwait(&set, &sig) == 0 ? 0 : -1;
+}
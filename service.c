@@ -0,0 +1,348 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "service.h"
+#include "rfc2822.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Other local programs can have stamps minted by the workers through a UNIX
+   socket. Each request is a line with the resource, which is an address, the
+   value and, optionally, the seconds the program is willing to wait:
+
+       user@example.com 20 30
+
+   and is answered by a line with "OK" and the stamp, or "ERR" and a reason.
+   The requests are minted as jobs of their own, scheduled with those of
+   messages and admitted in the same way, and minting stops if the program
+   disconnects. */
+
+#define SERVICE_CONNECTIONS 32
+#define SERVICE_LINE 1024
+#define SERVICE_IDLE 60      /* seconds to wait for a request */
+#define SERVICE_TIMEOUT 600  /* default seconds to mint a stamp */
+#define SERVICE_KEY "service" /* for sharing the workers */
+
+int service_fd = -1;
+int service_bits;
+struct string* (*service_begin)(const char* rcpt, const char* date, int bits,
+                                struct mint_stamp* stamp);
+
+pthread_attr_t service_attr;
+pthread_mutex_t service_mutex = PTHREAD_MUTEX_INITIALIZER;
+int service_connections = 0;
+
+
+/* Creates the socket, replacing any file at the path. */
+int service_open(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (unlink(path) == -1 && errno != ENOENT ||
+            bind(fd, (struct sockaddr*)&addr, sizeof addr) == -1 ||
+            listen(fd, SOMAXCONN) == -1 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        close(fd);
+        return -1;
+    }
+    service_fd = fd;
+    return 0;
+}
+
+/* Tells if the program is still connected, while waiting for the stamp. */
+int service_alive(void* arg) {
+    int fd = *(int*)arg;
+    ssize_t n;
+    char c;
+
+    n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || n == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                                errno != EINTR ? -1 : 0;
+}
+
+/* Mints a stamp for the recipient given as "local\0domain\0". Returns the
+   token, or NULL with the reason in error. */
+struct string* service_mint(int fd, const char* rcpt, int bits, long seconds,
+                            const char** error) {
+    struct mint_job job;
+    struct mint_stamp stamp;
+    struct pool_watch watch;
+    struct string* token;
+    char date[6+1], *s;
+    time_t now;
+    int len, done;
+
+    *error = "internal error";
+    if ((now = time(NULL)) == (time_t)-1 ||
+            format_date(now, 0, date, sizeof date - 1) == -1 ||
+            (token = service_begin(rcpt, date, bits, &stamp)) == NULL)
+        return NULL;
+
+    memset(&job, 0, sizeof job);
+    job.stamps = &stamp;
+    job.count = 1;
+    job.key = SERVICE_KEY;
+    memset(&watch, 0, sizeof watch);
+    if (pool_clock(&watch.deadline) == -1) {
+        free(token);
+        return NULL;
+    }
+    watch.deadline.tv_sec += seconds;
+    watch.progress = service_alive;
+    watch.arg = &fd;
+
+    if (pool_submit(&job, seconds) == -1) {
+        *error = "busy";
+        free(token);
+        return NULL;
+    }
+    pool_watch(&watch);
+    pool_attach(&job, &watch);
+    done = pool_follow(&job, &watch);
+    pool_unwatch(&watch);
+    pool_cancel(&job);
+
+    if (!done || stamp.found != 1) {
+        if (watch.lost)
+            *error = "disconnected";
+        else if (watch.expired)
+            *error = "timeout";
+        free(token);
+        return NULL;
+    }
+    len = mint_counter_len(stamp.bits);
+    s = strchr(token->string, '\0');
+    mint_counter(stamp.counter, len, s);
+    s[len] = '\0';
+    return token;
+}
+
+/* Handles a request line. Returns the reply. */
+struct string* service_request(int fd, char* line) {
+    char *resource, *arg, *end, *s, *rcpt;
+    const char* error = "invalid request";
+    struct string *token = NULL, *reply;
+    long bits, seconds = SERVICE_TIMEOUT;
+    size_t len;
+
+    if ((resource = strtok_r(line, " \t\r", &s)) == NULL ||
+            (arg = strtok_r(NULL, " \t\r", &s)) == NULL)
+        goto failed;
+    bits = strtol(arg, &end, 10);
+    if (*end || bits < 1 || bits > service_bits)
+        goto failed;
+    if ((arg = strtok_r(NULL, " \t\r", &s)) != NULL) {
+        seconds = strtol(arg, &end, 10);
+        if (*end || seconds < 1 || seconds > SERVICE_TIMEOUT)
+            goto failed;
+        if (strtok_r(NULL, " \t\r", &s) != NULL)
+            goto failed;
+    }
+
+    /* "local\0domain\0", as for message recipients */
+    len = strlen(resource);
+    if ((rcpt = malloc(len + 2)) == NULL) {
+        error = "internal error";
+        goto failed;
+    }
+    memcpy(rcpt, resource, len + 1);
+    rcpt[len + 1] = '\0';
+    if ((s = strrchr(rcpt, '@')) != NULL) {
+        *s = '\0';
+        if (rfc2822_is_dot_atom_text(rcpt) &&
+                rfc2822_is_dot_atom_text(s + 1))
+            token = service_mint(fd, rcpt, bits, seconds, &error);
+    }
+    free(rcpt);
+
+failed:
+    len = token != NULL ? strlen(token->string) : strlen(error);
+    if ((reply = malloc(sizeof *reply + 4 + len + 1 + 1)) != NULL)
+        sprintf(reply->string, "%s %s\n", token != NULL ? "OK" : "ERR",
+                token != NULL ? token->string : error);
+    if (token != NULL)
+        syslog(LOG_INFO, "service: minted stamp %s", token->string);
+    free(token);
+    return reply;
+}
+
+int service_send(int fd, const char* s) {
+    size_t len = strlen(s);
+    ssize_t n;
+
+    while (len != 0)
+        if ((n = send(fd, s, len, MSG_NOSIGNAL)) == -1) {
+            if (errno != EINTR)
+                return -1;
+        } else {
+            s += n;
+            len -= n;
+        }
+    return 0;
+}
+
+void* service_connection(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[SERVICE_LINE], *eol;
+    size_t len = 0;
+    ssize_t n;
+    struct timeval tv;
+    struct string* reply;
+
+    tv.tv_sec = SERVICE_IDLE;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    for (;;) {
+        if ((eol = memchr(buf, '\n', len)) == NULL) {
+            if (len == sizeof buf) {
+                service_send(fd, "ERR request too long\n");
+                break;
+            }
+            if ((n = recv(fd, buf + len, sizeof buf - len, 0)) == -1 &&
+                    errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            len += n;
+            continue;
+        }
+
+        *eol = '\0';
+        reply = service_request(fd, buf);
+        if (reply == NULL || service_send(fd, reply->string) == -1) {
+            free(reply);
+            break;
+        }
+        free(reply);
+        len -= eol + 1 - buf;
+        memmove(buf, eol + 1, len);
+    }
+
+    close(fd);
+    pthread_mutex_lock(&service_mutex);
+    service_connections--;
+    pthread_mutex_unlock(&service_mutex);
+    return NULL;
+}
+
+void* service_accept(void* arg) {
+    pthread_t thread;
+    int fd, full;
+
+    for (;;) {
+        if ((fd = accept(service_fd, NULL, NULL)) == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                syslog(LOG_ERR, "service: accept() failed: %m");
+                sleep(1);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&service_mutex);
+        if (!(full = service_connections >= SERVICE_CONNECTIONS))
+            service_connections++;
+        pthread_mutex_unlock(&service_mutex);
+        if (full) {
+            service_send(fd, "ERR busy\n");
+            close(fd);
+            continue;
+        }
+
+        if (pthread_create(&thread, &service_attr, service_connection,
+                           (void*)(intptr_t)fd) != 0) {
+            syslog(LOG_ERR, "service: couldn't start connection thread");
+            close(fd);
+            pthread_mutex_lock(&service_mutex);
+            service_connections--;
+            pthread_mutex_unlock(&service_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/* Starts taking requests for stamps of up to the given value on the socket
+   from service_open(), with begin making the token and laying out the stamp
+   as for a message. */
+int service_start(int bits,
+                  struct string* (*begin)(const char* rcpt, const char* date,
+                                          int bits,
+                                          struct mint_stamp* stamp)) {
+    pthread_t thread;
+    sigset_t set, old;
+    int status;
+
+    service_bits = bits;
+    service_begin = begin;
+
+    if ((status = pthread_attr_init(&service_attr)) != 0 ||
+            (status = pthread_attr_setdetachstate(
+                &service_attr, PTHREAD_CREATE_DETACHED)) != 0) {
+        errno = status;
+        return -1;
+    }
+
+    /* signals are left to the libmilter signal thread, and the threads for
+       connections inherit the mask */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    status = pthread_create(&thread, &service_attr, service_accept, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
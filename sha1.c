@@ -30,14 +30,85 @@
 
 #include "sha1.h"
 
+#ifdef USE_SHA_NI
+#include "sha1ni.h"
+#endif
+
 #undef S
 #define S(n, x) ((x) << (n) | (x) >> (32 - n))
 
+int sha1_ni = 0; /* use the SHA extensions, enabled by sha1_check() */
+
+#ifdef USE_SHA_NI
+SHA_TARGET
+void sha1_update_ni(struct sha1_info* info) {
+    __m128i abcd, abcd_save, e_save, e[2], msg[4];
+
+    abcd = SHA_LOAD(info->digest);
+    e[0] = _mm_set_epi32(info->digest[4], 0, 0, 0);
+    abcd_save = abcd;
+    e_save = e[0];
+
+    msg[0] = SHA_LOAD(&info->data[0]);
+    msg[1] = SHA_LOAD(&info->data[4]);
+    msg[2] = SHA_LOAD(&info->data[8]);
+    msg[3] = SHA_LOAD(&info->data[12]);
+
+    e[0] = _mm_add_epi32(e[0], msg[0]);
+    e[1] = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e[0], 0);
+
+    SHA_GROUP(1,  abcd, e, msg)
+    SHA_GROUP(2,  abcd, e, msg)
+    SHA_GROUP(3,  abcd, e, msg)
+    SHA_GROUP(4,  abcd, e, msg)
+    SHA_GROUP(5,  abcd, e, msg)
+    SHA_GROUP(6,  abcd, e, msg)
+    SHA_GROUP(7,  abcd, e, msg)
+    SHA_GROUP(8,  abcd, e, msg)
+    SHA_GROUP(9,  abcd, e, msg)
+    SHA_GROUP(10, abcd, e, msg)
+    SHA_GROUP(11, abcd, e, msg)
+    SHA_GROUP(12, abcd, e, msg)
+    SHA_GROUP(13, abcd, e, msg)
+    SHA_GROUP(14, abcd, e, msg)
+    SHA_GROUP(15, abcd, e, msg)
+    SHA_GROUP(16, abcd, e, msg)
+    SHA_GROUP(17, abcd, e, msg)
+    SHA_GROUP(18, abcd, e, msg)
+    SHA_GROUP(19, abcd, e, msg)
+
+    e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+
+    _mm_storeu_si128((__m128i*)info->digest, _mm_shuffle_epi32(abcd, 0x1b));
+    info->digest[4] = _mm_extract_epi32(e[0], 3);
+}
+#endif /* USE_SHA_NI */
+
+int sha1_ni_supported() {
+#ifdef USE_SHA_NI
+    unsigned a, b, c, d;
+
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA) &&
+           __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1);
+#else
+    return 0;
+#endif
+}
+
 void sha1_update(struct sha1_info* info) {
     uint32_t a, b, c, d, e, f, r;
     uint32_t u[16];
     uint32_t* w = &u[15];
 
+#ifdef USE_SHA_NI
+    if (sha1_ni) {
+        sha1_update_ni(info);
+        return;
+    }
+#endif
+
     a = info->digest[0];
     b = info->digest[1];
     c = info->digest[2];
@@ -180,7 +251,7 @@ const uint32_t check_xor[] = {
     0xafb2c16c, 0x3b093896, 0x631b16e7, 0x6cbf125a, 0xdc58ec67
 };
 
-int sha1_check() {
+int sha1_check_vectors() {
     int i, j;
     struct sha1_info info;
     uint32_t xor[5];
@@ -212,6 +283,24 @@ int sha1_check() {
     return 0;
 }
 
+/* Checks the portable implementation, then the SHA extensions if the CPU
+   supports them, leaving them enabled if they pass. */
+int sha1_check() {
+    sha1_ni = 0;
+    if (sha1_check_vectors() == -1)
+        return -1;
+
+    if (sha1_ni_supported()) {
+        sha1_ni = 1;
+        if (sha1_check_vectors() == -1) {
+            sha1_ni = 0;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 
 #ifdef TEST
 #include <stdio.h>
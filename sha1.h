@@ -41,7 +41,11 @@ struct sha1_info { /* copyable */
     uint32_t data[16];
 };
 
+extern int sha1_ni;
+
 int sha1_check();
+int sha1_ni_supported();
+void sha1_update(struct sha1_info* info);
 void sha1_begin(struct sha1_info* info);
 void sha1_char(struct sha1_info* info, char data);
 void sha1_string(struct sha1_info* info, const char* data, size_t len);
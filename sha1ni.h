@@ -0,0 +1,64 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* SHA-1 rounds using the x86 SHA extensions, shared by sha1.c and mint.c.
+   The state is held as ABCD with A in the highest lane, and message words are
+   held four to a register with the first word in the highest lane. */
+
+#ifndef SHA1NI_H
+#define SHA1NI_H
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+#define SHA_TARGET __attribute__((target("sha,sse4.1")))
+
+#define SHA_LOAD(p) \
+    _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(p)), 0x1b)
+
+/* Rounds 4*g to 4*g+3, with e[] alternating between the round input and the
+   previous state, and the schedule computed four words ahead in msg[]. Round
+   group 0 differs, as there is no previous state to derive E from. */
+#define SHA_GROUP(g, abcd, e, msg) \
+    e[(g)%2] = _mm_sha1nexte_epu32(e[(g)%2], msg[(g)%4]); \
+    e[((g)+1)%2] = abcd; \
+    if ((g) >= 3 && (g) <= 18) \
+        msg[((g)+1)%4] = _mm_sha1msg2_epu32(msg[((g)+1)%4], msg[(g)%4]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[(g)%2], (g)/5); \
+    if ((g) >= 1 && (g) <= 16) \
+        msg[((g)+3)%4] = _mm_sha1msg1_epu32(msg[((g)+3)%4], msg[(g)%4]); \
+    if ((g) >= 2 && (g) <= 17) \
+        msg[((g)+2)%4] = _mm_xor_si128(msg[((g)+2)%4], msg[(g)%4]);
+
+#endif /* SHA1NI_H */
@@ -0,0 +1,834 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "spent.h"
+#include "sha1.h"
+#include "util.h"
+
+#ifdef USE_DB185
+#include <db_185.h>
+#else
+#include <db.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Spent stamps are kept under their truncated tokens in a number of shards,
+   each a separate database with its own lock, chosen by a hash of the key. A
+   message's stamps are looked up and recorded with one lock round per shard.
+   With a single shard the database is the file itself, otherwise shard i is in
+   "file.i".
+
+   Expired stamps are purged by a thread of their own rather than while
+   checking messages. It deletes them in batches of SPENT_BATCH, taking the
+   shard's lock for each batch, and at most spent_rate a second, so a backlog
+   after a quiet period or at the turn of the day is spread out over time. The
+   same thread writes the databases to disk.
+
+   Since truncated tokens start with the date, the stamps can instead be kept
+   in a directory with a segment for each day, "YYMMDD" or "YYMMDD.i" for
+   shard i. A stamp is only looked up in the segment of its own date, and
+   expired stamps are purged by removing the segments of days outside the
+   range for which stamps are accepted.
+
+   The stamps can also be kept in a hash table of 64-bit records in a file
+   mapped into memory, with linear probing. A record has the day of the stamp
+   in its high 16 bits and the rest is a fingerprint from the SHA-1 of the key,
+   with the low bit set so that no record is zero, which marks a free slot.
+   Records are read and written atomically, without locks. An insert claims
+   the first free slot in the probe sequence, or the first expired record, and
+   then looks along the sequence again in case the same key was inserted at
+   the same time, so that of two such inserts at least one finds the other.
+   Expired records are just overwritten, so there is nothing to purge.
+
+   Since slots are never freed, the runs of records between free slots only
+   grow, and once the table has been in use for longer than records are kept
+   there may be no free slot to end a lookup. So the header also holds the
+   furthest any record was put from its own slot, raised before the record is
+   written, and lookups go no further than that. The stamps inserted and the
+   expired records they overwrote are counted as they're written, for the
+   statistics. */
+
+#define SPENT_SYNC 300     /* seconds between writing the databases to disk */
+#define SPENT_BATCH 100    /* stamps purged for each time a lock is taken */
+#define STATS_INTERVAL 300 /* seconds between logging the purge progress */
+#define SPENT_DAYS 40      /* segments open in each shard, for 28+2+2 days */
+
+struct spent_segment {
+    char date[6+1];        /* YYMMDD */
+    DB* db;                /* or NULL if the slot is free */
+};
+
+struct spent_shard {
+    DB* db;                /* or NULL if kept in segments */
+    struct spent_segment segments[SPENT_DAYS];
+    pthread_mutex_t mutex;
+    time_t sync;
+    long purged;
+    long dropped;          /* segments */
+    int behind;            /* expired stamps were left at the last batch */
+    char oldest[12+1];     /* date of the first of them */
+};
+
+struct spent_shard* spent_shards = NULL;
+int spent_count = 0;
+long spent_rate = 1000;
+
+char* spent_dir = NULL; /* of segments, or NULL if not kept in segments */
+
+pthread_t spent_thread;    /* the purger */
+int spent_started = 0;
+int spent_stop = 0;        /* set by spent_close() to end the purger */
+pthread_mutex_t spent_mutex = PTHREAD_MUTEX_INITIALIZER; /* for spent_stop */
+pthread_cond_t spent_wake = PTHREAD_COND_INITIALIZER;
+
+#define TABLE_MAGIC "hashcash-milter spent 1\n"
+#define TABLE_HEADER 64    /* bytes before the slots */
+#define TABLE_BOUND 40     /* offset of the furthest probe in the header */
+#define TABLE_PROBE 1024   /* slots looked at before the table is full */
+#define TABLE_DAYS (28+2+1) /* days that records are kept for */
+
+uint64_t* spent_table = NULL; /* or NULL if not kept in a table */
+uint64_t spent_slots = 0;  /* a power of 2 */
+uint64_t* spent_bound = NULL; /* furthest probe, in the header */
+long spent_inserted = 0;   /* records written since the table was opened */
+long spent_overwritten = 0; /* of them, over expired records */
+void* spent_map = NULL;
+size_t spent_map_size = 0;
+int spent_fd = -1;
+
+
+/* Opens a database file, locked for this process. */
+DB* spent_dbopen(const char* name) {
+    BTREEINFO info;
+    DB* db;
+    int fd, status;
+
+    memset(&info, 0, sizeof info);
+    info.minkeypage = 8;
+    info.compare = NULL;
+    info.prefix = NULL;
+    do
+        db = dbopen(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR, DB_BTREE, &info);
+    while (db == NULL && errno == EINTR);
+    if (db == NULL)
+        return NULL;
+
+    if ((fd = db->fd(db)) == -1)
+        goto failed;
+    do
+        status = flock(fd, LOCK_EX | LOCK_NB);
+    while (status == -1 && errno == EINTR);
+    if (status == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        goto failed;
+    return db;
+
+failed:
+    status = errno;
+    db->close(db);
+    errno = status;
+    return NULL;
+}
+
+/* Opens the hash table in the file, made with room for the given number of
+   stamps if it's new. */
+int spent_table_open(const char* file, long stamps) {
+    char header[TABLE_HEADER];
+    struct stat st;
+    int status;
+
+    for (spent_slots = 1024; spent_slots < (uint64_t)stamps * 2;
+         spent_slots *= 2);
+    spent_map_size = TABLE_HEADER + spent_slots * sizeof *spent_table;
+
+    do
+        spent_fd = open(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    while (spent_fd == -1 && errno == EINTR);
+    if (spent_fd == -1)
+        return -1;
+    do
+        status = flock(spent_fd, LOCK_EX | LOCK_NB);
+    while (status == -1 && errno == EINTR);
+    if (status == -1 || fcntl(spent_fd, F_SETFD, FD_CLOEXEC) == -1 ||
+            fstat(spent_fd, &st) == -1)
+        goto failed;
+
+    memset(header, 0, sizeof header);
+    if (st.st_size == 0) {
+        memcpy(header, TABLE_MAGIC, sizeof TABLE_MAGIC - 1);
+        memcpy(header + 32, &spent_slots, sizeof spent_slots);
+        if (ftruncate(spent_fd, spent_map_size) == -1 ||
+                pwrite(spent_fd, header, sizeof header, 0) != sizeof header)
+            goto failed;
+    } else if (pread(spent_fd, header, sizeof header, 0) != sizeof header ||
+               memcmp(header, TABLE_MAGIC, sizeof TABLE_MAGIC - 1) ||
+               memcmp(header + 32, &spent_slots, sizeof spent_slots) ||
+               st.st_size != (off_t)spent_map_size) {
+        errno = EINVAL;
+        goto failed;
+    }
+
+    if ((spent_map = mmap(NULL, spent_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, spent_fd, 0)) == MAP_FAILED) {
+        spent_map = NULL;
+        goto failed;
+    }
+    spent_table = (uint64_t*)((char*)spent_map + TABLE_HEADER);
+    spent_bound = (uint64_t*)((char*)spent_map + TABLE_BOUND);
+    return 0;
+
+failed:
+    status = errno;
+    close(spent_fd);
+    spent_fd = -1;
+    errno = status;
+    return -1;
+}
+
+/* Opens the databases for the given number of shards, the directory for
+   their segments if daily is set, or a hash table for the given number of
+   stamps if it's not zero. */
+int spent_open(const char* file, int shards, int daily, long stamps) {
+    struct spent_shard* shard;
+    char* name = NULL;
+    int status;
+
+    if ((spent_shards = calloc(shards, sizeof *spent_shards)) == NULL ||
+            (name = malloc(strlen(file) + 1 + 2 + 1)) == NULL)
+        goto failed;
+
+    if (daily) {
+        if (mkdir(file, S_IRWXU) == -1 && errno != EEXIST)
+            goto failed;
+        if ((spent_dir = strdup(file)) == NULL)
+            goto failed;
+    }
+    if (stamps != 0 && spent_table_open(file, stamps) == -1)
+        goto failed;
+
+    for (; spent_count < shards; spent_count++) {
+        shard = &spent_shards[spent_count];
+        if ((status = pthread_mutex_init(&shard->mutex, NULL)) != 0) {
+            errno = status;
+            goto failed;
+        }
+        if (daily || stamps != 0)
+            continue;
+
+        if (shards == 1)
+            strcpy(name, file);
+        else
+            sprintf(name, "%s.%d", file, spent_count);
+        if ((shard->db = spent_dbopen(name)) == NULL)
+            goto failed;
+    }
+    free(name);
+    return 0;
+
+failed:
+    status = errno;
+    spent_close();
+    free(name);
+    errno = status;
+    return -1;
+}
+
+/* Closes the segment in the slot, removing its file if drop is set. */
+int spent_segment_close(int i, struct spent_segment* segment, int drop) {
+    char* name;
+    int status = 0;
+
+    if (segment->db->close(segment->db) == -1)
+        status = -1;
+    segment->db = NULL;
+
+    if (drop) {
+        if ((name = malloc(strlen(spent_dir) + 1 + 6 + 1 + 2 + 1)) == NULL)
+            return -1;
+        if (spent_count == 1)
+            sprintf(name, "%s/%s", spent_dir, segment->date);
+        else
+            sprintf(name, "%s/%s.%d", spent_dir, segment->date, i);
+        if (unlink(name) == -1 && errno != ENOENT)
+            status = -1;
+        free(name);
+    }
+    return status;
+}
+
+int spent_close() {
+    struct spent_shard* shard;
+    int i, j, status = 0;
+
+    /* the purger may be using the table, so it is stopped first */
+    if (spent_started) {
+        pthread_mutex_lock(&spent_mutex);
+        __atomic_store_n(&spent_stop, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&spent_wake);
+        pthread_mutex_unlock(&spent_mutex);
+        pthread_join(spent_thread, NULL);
+        spent_started = 0;
+    }
+
+    for (i = 0; i < spent_count; i++) {
+        shard = &spent_shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        if (shard->db != NULL && shard->db->close(shard->db) == -1)
+            status = -1;
+        shard->db = NULL;
+        for (j = 0; j < SPENT_DAYS; j++)
+            if (shard->segments[j].db != NULL &&
+                    spent_segment_close(i, &shard->segments[j], 0) == -1)
+                status = -1;
+        pthread_mutex_unlock(&shard->mutex);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(spent_shards);
+    spent_shards = NULL;
+    spent_count = 0;
+    free(spent_dir);
+    spent_dir = NULL;
+    spent_stop = 0;
+
+    if (spent_map != NULL) {
+        if (msync(spent_map, spent_map_size, MS_SYNC) == -1)
+            status = -1;
+        munmap(spent_map, spent_map_size);
+        spent_map = NULL;
+        spent_table = NULL;
+        spent_bound = NULL;
+        spent_inserted = spent_overwritten = 0;
+    }
+    if (spent_fd != -1 && close(spent_fd) == -1)
+        status = -1;
+    spent_fd = -1;
+    return status;
+}
+
+/* Returns the day of a key dated YYMMDD, counted from 1970-01-01. */
+long spent_day(const char* key) {
+    long y = 2000 + (key[0] - '0') * 10 + (key[1] - '0'),
+         m = (key[2] - '0') * 10 + (key[3] - '0'),
+         d = (key[4] - '0') * 10 + (key[5] - '0');
+
+    /* counting years from March, so that the leap day comes last */
+    y -= m <= 2;
+    return y * 365 + y / 4 - y / 100 + y / 400 +
+           (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1 - 719468;
+}
+
+int spent_expired(uint64_t record, long today) {
+    uint16_t age = (uint16_t)(today - (long)(record >> 48));
+
+    return age > TABLE_DAYS && age < 0x8000;
+}
+
+/* Records the key in the table unless it's there already. Returns 0 if it
+   wasn't, 1 if it was, or -1 if the table is full. */
+int spent_insert(const char* key, long today) {
+    struct sha1_info info;
+    uint64_t mask = spent_slots - 1, record, old, expected = 0, slot, target, i;
+    uint64_t n, bound, distance = 0;
+
+    sha1_begin(&info);
+    sha1_string(&info, key, strlen(key));
+    sha1_done(&info);
+    slot = ((uint64_t)info.digest[0] << 32 | info.digest[1]) & mask;
+    record = (uint64_t)(spent_day(key) & 0xffff) << 48 |
+             ((uint64_t)info.digest[2] << 32 | info.digest[3]) &
+             0xffffffffffffull | 1;
+
+again:
+    bound = __atomic_load_n(spent_bound, __ATOMIC_SEQ_CST);
+    target = spent_slots; /* none */
+    for (n = 0, i = slot; n < TABLE_PROBE; n++, i = (i + 1) & mask) {
+        old = __atomic_load_n(&spent_table[i], __ATOMIC_SEQ_CST);
+        if (old == record)
+            return 1;
+        if (target == spent_slots && (old == 0 || spent_expired(old, today))) {
+            target = i;
+            expected = old;
+            distance = n;
+        }
+        if (old == 0 || target != spent_slots && n >= bound)
+            break;
+    }
+    if (target == spent_slots)
+        return -1;
+
+    /* the bound is raised first, so that an insert of the same key that
+       doesn't see the record looks far enough along to find it later */
+    while (distance > bound &&
+           !__atomic_compare_exchange_n(spent_bound, &bound, distance, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    if (!__atomic_compare_exchange_n(&spent_table[target], &expected, record,
+                                     0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        goto again;
+    __atomic_add_fetch(&spent_inserted, 1, __ATOMIC_RELAXED);
+    if (expected != 0)
+        __atomic_add_fetch(&spent_overwritten, 1, __ATOMIC_RELAXED);
+
+    /* the same key may have been inserted further along at the same time */
+    bound = __atomic_load_n(spent_bound, __ATOMIC_SEQ_CST);
+    for (n = 0, i = slot; n <= bound; n++, i = (i + 1) & mask) {
+        old = __atomic_load_n(&spent_table[i], __ATOMIC_SEQ_CST);
+        if (old == 0)
+            break;
+        if (old == record && i != target)
+            return 1;
+    }
+    return 0;
+}
+
+/* Returns the segment of shard i for the date the key starts with, which is
+   opened if it isn't yet, or NULL. The shard is locked. */
+DB* spent_segment(int i, const char* key, const char* queue_id) {
+    struct spent_shard* shard = &spent_shards[i];
+    struct spent_segment *segment, *slot = NULL;
+    char* name;
+    int j;
+
+    if (strspn(key, "0123456789") < 6) {
+        syslog(LOG_ERR, "%s: internal error: spent stamp not dated",
+               queue_id);
+        return NULL;
+    }
+    for (j = 0; j < SPENT_DAYS; j++) {
+        segment = &shard->segments[j];
+        if (segment->db == NULL) {
+            if (slot == NULL)
+                slot = segment;
+        } else if (!memcmp(segment->date, key, 6))
+            return segment->db;
+    }
+    if (slot == NULL) {
+        syslog(LOG_WARNING, "%s: too many days in double-spend database, "
+               "stamp will not be checked", queue_id);
+        return NULL;
+    }
+
+    if ((name = malloc(strlen(spent_dir) + 1 + 6 + 1 + 2 + 1)) == NULL) {
+        syslog(LOG_ERR, "%s: memory allocation failed", queue_id);
+        return NULL;
+    }
+    memcpy(slot->date, key, 6);
+    slot->date[6] = '\0';
+    if (spent_count == 1)
+        sprintf(name, "%s/%s", spent_dir, slot->date);
+    else
+        sprintf(name, "%s/%s.%d", spent_dir, slot->date, i);
+    if ((slot->db = spent_dbopen(name)) == NULL)
+        syslog(LOG_WARNING, "%s: couldn't open %s: %m; "
+               "double-spend database will not be checked", queue_id, name);
+    free(name);
+    return slot->db;
+}
+
+/* FNV-1a, which is enough to spread keys evenly between shards. */
+int spent_shard(const char* key) {
+    uint32_t hash = 2166136261u;
+
+    for (; *key; key++)
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    return hash % spent_count;
+}
+
+/* Purges up to max stamps dated outside the range from the shard, which is
+   locked. Returns the number purged, or -1 on error. */
+int spent_purge(struct spent_shard* shard, const char* date1,
+                const char* date2, int max) {
+    DB* db = shard->db;
+    DBT key, value;
+    u_int flag;
+    const char* sep;
+    size_t len;
+    int purged = 0;
+
+    shard->behind = 0;
+    memset(&key, 0, sizeof key);
+    memset(&value, 0, sizeof value);
+    for (flag = R_FIRST;;) {
+        switch (db->seq(db, &key, &value, flag)) {
+        case -1:
+            syslog(LOG_WARNING, "db->seq() failed: %m; "
+                   "expired stamps will not be purged from "
+                   "double-spend database");
+            return -1;
+        case 1:
+            return purged;
+        }
+        sep = memchr(key.data, ':', key.size);
+        len = sep != NULL ? (size_t)(sep - (const char*)key.data) : key.size;
+        if (flag == R_FIRST) {
+            if (len > strlen(date1))
+                len = strlen(date1);
+            if (len >= 6 && memcmp(key.data, date1, len) >= 0) {
+                flag = R_LAST;
+                continue;
+            }
+        } else {
+            if (len > strlen(date2))
+                len = strlen(date2);
+            if (len >= 6 && memcmp(key.data, date2, len) <= 0)
+                return purged;
+        }
+
+        if (purged == max) {
+            shard->behind = 1;
+            if (len > sizeof shard->oldest - 1)
+                len = sizeof shard->oldest - 1;
+            memcpy(shard->oldest, key.data, len);
+            shard->oldest[len] = '\0';
+            return purged;
+        }
+        switch (db->del(db, &key, R_CURSOR)) {
+        case -1:
+            syslog(LOG_WARNING, "db->del() failed: %m; "
+                   "expired stamps will not be purged from "
+                   "double-spend database");
+            return -1;
+        case 1:
+            syslog(LOG_ERR, "internal error: "
+                   "key not found in double-spend database");
+            return -1;
+        }
+        purged++;
+        shard->purged++;
+    }
+}
+
+/* Looks up the stamps and records those not yet spent, taking the lock of
+   each shard once. Keys that are NULL are skipped. */
+void spent_check(struct spent_key* keys, int count, const char* queue_id) {
+    struct spent_shard* shard;
+    DB* db;
+    DBT key, value;
+    uint64_t done = 0; /* shards */
+    long today;
+    int i, j, s;
+
+    if (spent_table != NULL) {
+        today = time(NULL) / 86400;
+        for (i = 0; i < count; i++)
+            if (keys[i].key == NULL)
+                keys[i].spent = -1;
+            else if ((keys[i].spent = spent_insert(keys[i].key,
+                                                   today)) == -1)
+                syslog(LOG_WARNING, "%s: double-spend table is full, "
+                       "stamp will not be checked", queue_id);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        keys[i].shard = keys[i].key != NULL ? spent_shard(keys[i].key) : -1;
+        keys[i].spent = -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if ((s = keys[i].shard) == -1 || done >> s & 1)
+            continue;
+        done |= (uint64_t)1 << s;
+        shard = &spent_shards[s];
+
+        if (pthread_mutex_lock(&shard->mutex) != 0) {
+            syslog(LOG_WARNING, "%s: pthread_mutex_lock() failed, "
+                   "double-spend database will not be checked", queue_id);
+            continue;
+        }
+
+        /* record the stamps of this shard */
+        for (j = i; j < count; j++) {
+            if (keys[j].shard != s)
+                continue;
+            if ((db = spent_dir != NULL ?
+                          spent_segment(s, keys[j].key, queue_id) :
+                          shard->db) == NULL)
+                continue;
+            memset(&key, 0, sizeof key);
+            memset(&value, 0, sizeof value);
+            key.data = (void*)keys[j].key;
+            key.size = strlen(keys[j].key);
+            value.data = "";
+            value.size = 0;
+
+            switch (db->put(db, &key, &value, R_NOOVERWRITE)) {
+            case 0:
+                keys[j].spent = 0;
+                break;
+            case 1:
+                keys[j].spent = 1;
+                break;
+            case -1:
+                syslog(LOG_WARNING, "%s: db->put() failed: %m; "
+                       "double-spend database will not be checked",
+                       queue_id);
+            }
+        }
+
+        if (pthread_mutex_unlock(&shard->mutex) != 0)
+            syslog(LOG_WARNING, "%s: pthread_mutex_unlock() failed",
+                   queue_id);
+    }
+}
+
+void spent_stats(struct spent_stats* stats) {
+    struct spent_shard* shard;
+    int i;
+
+    memset(stats, 0, sizeof *stats);
+    if (spent_table != NULL) {
+        stats->inserted = __atomic_load_n(&spent_inserted, __ATOMIC_RELAXED);
+        stats->overwritten = __atomic_load_n(&spent_overwritten,
+                                             __ATOMIC_RELAXED);
+        stats->bound = __atomic_load_n(spent_bound, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < spent_count; i++) {
+        shard = &spent_shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->purged += shard->purged;
+        stats->dropped += shard->dropped;
+        if (shard->behind) {
+            stats->behind++;
+            if (!*stats->oldest || strcmp(shard->oldest, stats->oldest) < 0)
+                strcpy(stats->oldest, shard->oldest);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+/* Removes the segments of shard i dated outside the range. The shard is
+   locked. */
+void spent_drop(int i, const char* date1, const char* date2) {
+    struct spent_segment* segment;
+    int j;
+
+    for (j = 0; j < SPENT_DAYS; j++) {
+        segment = &spent_shards[i].segments[j];
+        if (segment->db == NULL || (memcmp(segment->date, date1, 6) >= 0 &&
+                                    memcmp(segment->date, date2, 6) <= 0))
+            continue;
+        if (spent_segment_close(i, segment, 1) == -1)
+            syslog(LOG_WARNING, "couldn't remove %s from double-spend "
+                   "database: %m", segment->date);
+        spent_shards[i].dropped++;
+    }
+}
+
+/* Removes files of segments dated outside the range that weren't open. */
+void spent_scan(const char* date1, const char* date2) {
+    DIR* dir;
+    struct dirent* entry;
+    char *name, *end;
+    const char* s;
+
+    if ((dir = opendir(spent_dir)) == NULL) {
+        syslog(LOG_WARNING, "opendir(%s) failed: %m", spent_dir);
+        return;
+    }
+    if ((name = malloc(strlen(spent_dir) + 1 + NAME_MAX + 1)) == NULL) {
+        closedir(dir);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        s = entry->d_name;
+        if (strspn(s, "0123456789") != 6 ||
+                (memcmp(s, date1, 6) >= 0 && memcmp(s, date2, 6) <= 0))
+            continue;
+        if (spent_count == 1 ? s[6] != '\0' :
+                s[6] != '.' || strspn(s + 7, "0123456789") == 0 ||
+                strtol(s + 7, &end, 10) >= spent_count || *end)
+            continue;
+        sprintf(name, "%s/%s", spent_dir, s);
+        if (unlink(name) == -1)
+            syslog(LOG_WARNING, "couldn't remove %s from double-spend "
+                   "database: %m", s);
+    }
+    free(name);
+    closedir(dir);
+}
+
+/* Purges a batch from shard i and writes it to disk when due. Returns the
+   number purged, or -1 if it's done for now. */
+int spent_batch(int i, time_t now, const char* date1, const char* date2,
+                int max) {
+    struct spent_shard* shard = &spent_shards[i];
+    int purged = -1, j;
+
+    if (pthread_mutex_lock(&shard->mutex) != 0)
+        return -1;
+    if (shard->db != NULL) {
+        /* don't purge around the turn of the century */
+        if (strcmp(date1, date2) <= 0 && max > 0) {
+            purged = spent_purge(shard, date1, date2, max);
+            if (!shard->behind)
+                purged = -1;
+        }
+
+        /* sync to disk every 5 minutes */
+        if (now >= shard->sync) {
+            if (shard->sync != 0 && shard->db->sync(shard->db, 0) == -1)
+                syslog(LOG_WARNING, "db->sync() failed: %m");
+            shard->sync = now + SPENT_SYNC;
+        }
+    } else if (spent_map != NULL) {
+        if (now >= shard->sync) {
+            if (shard->sync != 0 &&
+                    msync(spent_map, spent_map_size, MS_ASYNC) == -1)
+                syslog(LOG_WARNING, "msync() failed: %m");
+            shard->sync = now + SPENT_SYNC;
+        }
+    } else if (spent_dir != NULL) {
+        if (strcmp(date1, date2) <= 0)
+            spent_drop(i, date1, date2);
+
+        if (now >= shard->sync) {
+            for (j = 0; j < SPENT_DAYS; j++)
+                if (shard->sync != 0 && shard->segments[j].db != NULL &&
+                        shard->segments[j].db->sync(
+                            shard->segments[j].db, 0) == -1)
+                    syslog(LOG_WARNING, "db->sync() failed: %m");
+            shard->sync = now + SPENT_SYNC;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return purged;
+}
+
+/* Waits a second, or until spent_close(). Returns 1 if the purger is to
+   stop. */
+int spent_wait() {
+    struct timespec until;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec++;
+    pthread_mutex_lock(&spent_mutex);
+    while (!spent_stop && pthread_cond_timedwait(&spent_wake, &spent_mutex,
+                                                 &until) != ETIMEDOUT);
+    stop = spent_stop;
+    pthread_mutex_unlock(&spent_mutex);
+    return stop;
+}
+
+void* spent_purger(void* arg) {
+    struct spent_stats stats;
+    char date1[12+1], date2[12+1], scanned[6+1] = "";
+    time_t now, logged;
+    uint64_t done, all;    /* shards */
+    long budget;
+    int i, n, next = 0, purged;
+
+    all = spent_count < 64 ? ((uint64_t)1 << spent_count) - 1 : ~(uint64_t)0;
+    logged = time(NULL);
+    while (!spent_wait()) {
+        if ((now = time(NULL)) == (time_t)-1 ||
+                format_date(now, -(28 + 2) * 86400,
+                            date1, sizeof date1 - 1) == -1 ||
+                format_date(now, 2 * 86400, date2, sizeof date2 - 1) == -1)
+            continue;
+
+        /* go round the shards a batch at a time, starting on the shard where
+           the last second's budget ran out */
+        budget = spent_rate;
+        for (done = 0, i = next; done != all; i = (i + 1) % spent_count) {
+            if (done >> i & 1)
+                continue;
+            n = budget < SPENT_BATCH ? budget : SPENT_BATCH;
+            if ((purged = spent_batch(i, now, date1, date2, n)) == -1)
+                done |= (uint64_t)1 << i;
+            else if ((budget -= purged) <= 0)
+                break;
+        }
+        next = i;
+
+        /* segments that weren't open are removed once a day */
+        if (spent_dir != NULL && strcmp(date1, date2) <= 0 &&
+                memcmp(scanned, date1, 6)) {
+            spent_scan(date1, date2);
+            memcpy(scanned, date1, 6);
+        }
+
+        if (now >= logged + STATS_INTERVAL) {
+            spent_stats(&stats);
+            if (spent_table != NULL)
+                syslog(LOG_INFO, "double-spend table: %ld stamps recorded "
+                       "(%ld over expired ones) in %ld slots, lookups of up "
+                       "to %ld slots", stats.inserted, stats.overwritten,
+                       (long)spent_slots, stats.bound + 1);
+            else if (spent_dir != NULL)
+                syslog(LOG_INFO, "double-spend database: %ld days of "
+                       "expired stamps removed", stats.dropped);
+            else if (stats.behind)
+                syslog(LOG_INFO, "double-spend database: %ld expired stamps "
+                       "purged, more left in %d of %d files from %s",
+                       stats.purged, stats.behind, spent_count, stats.oldest);
+            else
+                syslog(LOG_INFO, "double-spend database: %ld expired stamps "
+                       "purged", stats.purged);
+            logged = now;
+        }
+    }
+
+    return NULL;
+}
+
+/* Starts purging expired stamps in the background, until spent_close(). */
+int spent_start() {
+    sigset_t set, old;
+    int status;
+
+    /* signals are left to the libmilter signal thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    status = pthread_create(&spent_thread, NULL, spent_purger, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    spent_started = 1;
+    return 0;
+}
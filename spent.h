@@ -0,0 +1,65 @@
+/*
+ * Part of Hashcash Milter version 0.1.3 from <http://althenia.net/hashcash>.
+ *
+ * Copyright 2010 Andrey Zholos.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SPENT_H
+#define SPENT_H
+
+#include <time.h>
+
+#define SPENT_SHARDS_MAX 64
+
+/* A stamp to be looked up and recorded, keyed by its truncated token. */
+struct spent_key {
+    const char* key;
+    int shard;
+    int spent;             /* set to 1 if already spent, 0 if recorded now,
+                              or -1 if it couldn't be checked */
+};
+
+struct spent_stats {
+    long purged;           /* expired stamps */
+    long dropped;          /* segments of expired stamps */
+    long inserted;         /* stamps recorded in the table */
+    long overwritten;      /* of them, over expired stamps */
+    long bound;            /* furthest a stamp is from its slot */
+    int behind;            /* shards with expired stamps left */
+    char oldest[12+1];     /* date of the oldest of them */
+};
+
+extern int spent_count; /* shards, or 0 if not open */
+extern long spent_rate; /* expired stamps purged per second */
+
+int spent_open(const char* file, int shards, int daily, long stamps);
+int spent_close();
+int spent_start();
+void spent_check(struct spent_key* keys, int count, const char* queue_id);
+void spent_stats(struct spent_stats* stats);
+
+#endif /* SPENT_H */
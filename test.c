@@ -28,6 +28,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "pool.h"
+#include "spent.h"
 #include "util.h"
 
 #include <ctype.h>
@@ -41,12 +43,17 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include <libmilter/mfapi.h>
 
 extern struct ipaddr* cover_ipaddrs;
 extern struct string* cover_domains;
-extern int random_fd;
+extern int entropy_fd;
+extern int mint_bits;
+extern int cover_auth;
+extern int overflow_tempfail;
+extern int mint_early;
 
 sfsistat hcfi_connect(SMFICTX* ctx, char* hostname, _SOCK_ADDR* hostaddr);
 sfsistat hcfi_envfrom(SMFICTX* ctx, char** argv);
@@ -69,8 +76,12 @@ void syslog(int priority, const char* message, ...) {
 }
 
 
+time_t test_now = 1267354128;
+
 time_t time(time_t* t) {
-    return 1267354128;
+    if (t != NULL)
+        *t = test_now;
+    return test_now;
 }
 
 
@@ -117,8 +128,12 @@ int smfi_addheader(SMFICTX* ctx, char* headerf, char* headerv) {
     return MI_SUCCESS;
 }
 
+int test_stamps = 0; /* added to the last message */
+
 int smfi_insheader(SMFICTX* ctx, int hdridx, char* headerf, char* headerv) {
     printf("insert header at %d: %s: %s\n", hdridx, headerf, headerv);
+    if (!strcmp(headerf, "X-Hashcash"))
+        test_stamps++;
     return MI_SUCCESS;
 }
 
@@ -153,6 +168,20 @@ char* tests[][2] = {
     { "To",         "\"Roe Deer\" <deer@forest.example>" },
     { "CC",         "\"Red Squirrel\" <squirrel@forest.example>, "
                     "\"Fire Bird\" <firebird@enchanted.forest.example>" },
+    { "Message-ID", "<20100228104828.GA1234@forest.example>" },
+    { NULL,         NULL },
+
+    /* outgoing, same message sent again, takes tokens from journal with -j */
+    { "192.0.2.1",
+                    "<hare@forest.example>" },               /* MAIL */
+    { NULL,         "<deer@forest.example>" },               /* RCPT */
+    { NULL,         "<squirrel@forest.example>" },           /* RCPT */
+    { NULL,         "<firebird@enchanted.forest.example>" }, /* RCPT */
+    { "From",       "\"Brown Hare\" <hare@forest.example>" },
+    { "To",         "\"Roe Deer\" <deer@forest.example>" },
+    { "CC",         "\"Red Squirrel\" <squirrel@forest.example>, "
+                    "\"Fire Bird\" <firebird@enchanted.forest.example>" },
+    { "Message-ID", "<20100228104828.GA1234@forest.example>" },
     { NULL,         NULL },
 
     /* incoming, check two tokens */
@@ -264,67 +293,209 @@ char* tests[][2] = {
     { NULL,         NULL }
 };
 
-int smfi_main() {
+/* Checks the keys against the spent stamps, expecting each to be spent or
+   not as given. */
+void test_check(char** keys, const int* spent, int count) {
+    struct spent_key checked[8];
+    int i;
+
+    for (i = 0; i < count; i++)
+        checked[i].key = keys[i];
+    spent_check(checked, count, "[ID]");
+    for (i = 0; i < count; i++)
+        if (checked[i].spent != spent[i])
+            errx(EXIT_FAILURE, "stamp %s %s spent", keys[i],
+                 spent[i] ? "not" : "wrongly");
+}
+
+/* Tries each way of keeping spent stamps in a temporary directory. */
+void test_spent() {
+    char dir[] = "/tmp/hashcash-test.XXXXXX", name[sizeof dir + 32];
+    char* keys[] = { "100228:fox@forest.example::a",
+                     "100228:fox@forest.example::b",
+                     "100228:hare@forest.example::a",
+                     "100228:fox@forest.example::a" }; /* again */
+    const int fresh[] = { 0, 0, 0, 1 }, spent[] = { 1, 1, 1, 1 };
+    char* later[] = { "100409:fox@forest.example::a" };
+    const int later_fresh[] = { 0 };
+    int i;
+
+    if (mkdtemp(dir) == NULL)
+        err(EXIT_FAILURE, "mkdtemp() failed");
+
+    printf("spent stamps in hash table\n");
+    sprintf(name, "%s/table", dir);
+    if (spent_open(name, 1, 0, 1000) == -1)
+        err(EXIT_FAILURE, "spent_open() failed");
+    test_check(keys, fresh, 4);
+    test_check(keys, spent, 4);
+    if (spent_close() == -1 || spent_open(name, 1, 0, 1000) == -1)
+        err(EXIT_FAILURE, "reopening table failed");
+    test_check(keys, spent, 4);
+    if (spent_close() == -1)
+        err(EXIT_FAILURE, "spent_close() failed");
+    unlink(name);
+
+    printf("spent stamps in shards\n");
+    sprintf(name, "%s/spent", dir);
+    if (spent_open(name, 4, 0, 0) == -1)
+        err(EXIT_FAILURE, "spent_open() failed");
+    test_check(keys, fresh, 4);
+    test_check(keys, spent, 4);
+    if (spent_close() == -1)
+        err(EXIT_FAILURE, "spent_close() failed");
+    for (i = 0; i < 4; i++) {
+        sprintf(name, "%s/spent.%d", dir, i);
+        unlink(name);
+    }
+
+    printf("spent stamps in daily segments\n");
+    sprintf(name, "%s/daily", dir);
+    if (spent_open(name, 2, 1, 0) == -1)
+        err(EXIT_FAILURE, "spent_open() failed");
+    test_check(keys, fresh, 4);
+    test_now += 40 * 86400;
+    test_check(later, later_fresh, 1);
+    if (spent_start() == -1)
+        err(EXIT_FAILURE, "spent_start() failed");
+    sleep(2); /* for the purger to drop the first day */
+    if (spent_close() == -1)
+        err(EXIT_FAILURE, "spent_close() failed");
+    test_now -= 40 * 86400;
+    for (i = 0; i < 2; i++) {
+        sprintf(name, "%s/daily/100228.%d", dir, i);
+        if (access(name, F_OK) == 0)
+            errx(EXIT_FAILURE, "expired segment %s not removed", name);
+        sprintf(name, "%s/daily/100409.%d", dir, i);
+        unlink(name);
+    }
+    sprintf(name, "%s/daily", dir);
+    if (rmdir(name) == -1 || rmdir(dir) == -1)
+        err(EXIT_FAILURE, "rmdir() failed");
+}
+
+/* Sends the message starting at tests[i] through the milter. Returns the
+   index of the empty entry ending it. */
+int test_message(char* tests[][2], int i) {
     struct sockaddr_in in;
     struct sockaddr_in6 in6;
-    struct ipaddr* next_addr;
-    int i, count, status;
+    int status;
 
     memset(&in, 0, sizeof in);
     memset(&in6, 0, sizeof in6);
 
-    /*do
-        random_fd = open("/dev/zero", O_RDONLY);
-    while (random_fd == -1 && errno == EINTR);
-    if (random_fd == -1)
-        err(EXIT_FAILURE, "open(/dev/zero) failed");*/
+    if (isdigit(*tests[i][0]))
+        if (strchr(tests[i][0], ':') != NULL) {
+            in6.sin6_family = AF_INET6;
+            if (inet_pton(AF_INET6, tests[i][0], &in6.sin6_addr) != 1)
+                errx(EXIT_FAILURE, "inet_pton() failed");
+            status = hcfi_connect(NULL, NULL, (void*)&in6);
+        } else {
+            in.sin_family = AF_INET;
+            if (inet_aton(tests[i][0], &in.sin_addr) != 1)
+                errx(EXIT_FAILURE, "inet_aton() failed");
+            status = hcfi_connect(NULL, NULL, (void*)&in);
+        }
+    else
+        status = hcfi_connect(NULL, NULL, NULL);
 
-    count = 0;
-    for (i = 0;; i++) {
-        if (tests[i][1] == NULL)
-            break;
+    symval_i = "[ID]";
+    symval_j = "forest.example";
+    symval_auth_type = *tests[i][0] == 'a' ? "PLAIN" : "";
+    test_stamps = 0;
 
-        printf("message %d\n", ++count);
+    if (status == SMFIS_CONTINUE)
+        status = hcfi_envfrom(NULL, &tests[i++][1]);
 
-        if (isdigit(*tests[i][0]))
-            if (strchr(tests[i][0], ':') != NULL) {
-                in6.sin6_family = AF_INET6;
-                if (inet_pton(AF_INET6, tests[i][0], &in6.sin6_addr) != 1)
-                    errx(EXIT_FAILURE, "inet_pton() failed");
-                status = hcfi_connect(NULL, NULL, (void*)&in6);
-            } else {
-                in.sin_family = AF_INET;
-                if (inet_aton(tests[i][0], &in.sin_addr) != 1)
-                    errx(EXIT_FAILURE, "inet_aton() failed");
-                status = hcfi_connect(NULL, NULL, (void*)&in);
-            }
-        else
-            status = hcfi_connect(NULL, NULL, NULL);
-
-        symval_i = "[ID]";
-        symval_j = "forest.example";
-        symval_auth_type = *tests[i][0] == 'a' ? "PLAIN" : "";
+    for (; tests[i][0] == NULL; i++)
+        if (status == SMFIS_CONTINUE)
+            status = hcfi_envrcpt(NULL, &tests[i][1]);
 
+    for (; tests[i][0] != NULL; i++)
         if (status == SMFIS_CONTINUE)
-            status = hcfi_envfrom(NULL, &tests[i++][1]);
+            status = hcfi_header(NULL, tests[i][0], tests[i][1]);
 
-        for (; tests[i][0] == NULL; i++)
-            if (status == SMFIS_CONTINUE)
-                status = hcfi_envrcpt(NULL, &tests[i][1]);
+    if (status == SMFIS_CONTINUE)
+        status = hcfi_eom(NULL);
 
-        for (; tests[i][0] != NULL; i++)
-            if (status == SMFIS_CONTINUE)
-                status = hcfi_header(NULL, tests[i][0], tests[i][1]);
+    if (status != SMFIS_ACCEPT)
+        errx(EXIT_FAILURE, "test message not accepted");
 
-        if (status == SMFIS_CONTINUE)
-            status = hcfi_eom(NULL);
+    hcfi_close(NULL);
+    return i;
+}
+
+char* tests_pool[][2] = {
+    /* outgoing by SMTP auth, three recipients in the headers */
+    { "a",
+                    "hare@forest.example" },                 /* MAIL */
+    { NULL,         "deer@forest.example" },                 /* RCPT */
+    { NULL,         "squirrel@forest.example" },             /* RCPT */
+    { NULL,         "firebird@enchanted.forest.example" },   /* RCPT */
+    { "From",       "Brown Hare <hare@forest.example>" },
+    { "To",         "Roe Deer <deer@forest.example>" },
+    { "CC",         "Red Squirrel <squirrel@forest.example>, "
+                    "Fire Bird <firebird@enchanted.forest.example>" },
+    { NULL,         NULL }
+};
+
+/* Tries a message with the minting queue full, which only gets stamps if
+   they're started early, since those don't count towards the limit. */
+void test_pool() {
+    int early = mint_early, queue_max = pool_queue_max,
+        tempfail = overflow_tempfail;
+    struct mint_stamp stamp;
+    struct mint_job job;
+
+    /* a job that's never minted holds the only place in the queue */
+    pool_queue_max = 1;
+    overflow_tempfail = 0;
+    memset(&stamp, 0, sizeof stamp);
+    memset(&job, 0, sizeof job);
+    job.stamps = &stamp;
+    job.count = 1;
+    if (pool_submit(&job, 0) == -1)
+        errx(EXIT_FAILURE, "pool_submit() failed");
+
+    printf("message with the queue full and stamps started early\n");
+    mint_early = 1;
+    test_message(tests_pool, 0);
+    if (test_stamps != 3)
+        errx(EXIT_FAILURE, "added %d of 3 stamps", test_stamps);
+
+    printf("message with the queue full\n");
+    mint_early = 0;
+    test_message(tests_pool, 0);
+    if (test_stamps != 0)
+        errx(EXIT_FAILURE, "added %d stamps to overflow", test_stamps);
+
+    pool_cancel(&job);
+    mint_early = early;
+    pool_queue_max = queue_max;
+    overflow_tempfail = tempfail;
+}
 
-        if (status != SMFIS_ACCEPT)
-            errx(EXIT_FAILURE, "test message not accepted");
+int smfi_main() {
+    struct ipaddr* next_addr;
+    int i, count;
 
-        hcfi_close(NULL);
+    /*do
+        entropy_fd = open("/dev/zero", O_RDONLY);
+    while (entropy_fd == -1 && errno == EINTR);
+    if (entropy_fd == -1)
+        err(EXIT_FAILURE, "open(/dev/zero) failed");*/
+
+    count = 0;
+    for (i = 0; tests[i][1] != NULL; i++) {
+        printf("message %d\n", ++count);
+        i = test_message(tests, i);
     }
 
+    if (mint_bits != 0 && cover_auth)
+        test_pool();
+    if (spent_count == 0)
+        test_spent();
+
     for (; cover_ipaddrs; cover_ipaddrs = next_addr) {
         next_addr = cover_ipaddrs->next;
         free(cover_ipaddrs);
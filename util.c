@@ -195,6 +195,26 @@ int match_ipaddr(void* hostaddr, const struct ipaddr* match) {
     return 0;
 }
 
+/* Writes the address as text, or "local" for local domain sockets. */
+int format_ipaddr(void* hostaddr, char* s, size_t size) {
+    switch (((struct sockaddr*)hostaddr)->sa_family) {
+    case AF_INET:
+        return inet_ntop(AF_INET, &((struct sockaddr_in*)hostaddr)->sin_addr,
+                         s, size) != NULL ? 0 : -1;
+    case AF_INET6:
+        return inet_ntop(AF_INET6,
+                         &((struct sockaddr_in6*)hostaddr)->sin6_addr,
+                         s, size) != NULL ? 0 : -1;
+    case AF_LOCAL:
+        if (size < sizeof "local")
+            return -1;
+        strcpy(s, "local");
+        return 0;
+    }
+
+    return -1;
+}
+
 
 struct string* parse_domains(char* list) {
     char* item;
@@ -63,6 +63,7 @@ void free_integers(struct integer* s);
 
 struct ipaddr* parse_ipaddrs(char* list);
 int match_ipaddr(void* hostaddr, const struct ipaddr* match);
+int format_ipaddr(void* hostaddr, char* s, size_t size);
 
 struct string* parse_domains(char* list);
 int match_domain(const char* dom, const struct string* match);